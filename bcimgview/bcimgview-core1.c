@@ -23,11 +23,28 @@ unsigned char bcprog_magic[8] =
 unsigned char bcflat_magic[8] =
     {0x42, 0x43, 0x46, 0x4c, 0xc3, 0x84, 0x54, 0x0a};
 
+unsigned char bcflat2_magic[8] =
+    {0x42, 0x43, 0x46, 0x32, 0xc3, 0x84, 0x54, 0x0a};
+
+unsigned char bcseq_magic[8] =
+    {0x42, 0x43, 0x53, 0x51, 0xc3, 0x84, 0x54, 0x0a};
+
+unsigned char bcpack_magic[8] =
+    {0x42, 0x43, 0x50, 0x4b, 0xc3, 0x84, 0x54, 0x0a};
+
+/* Number of allocations made with xmalloc by the current thread, so
+   that code which shouldn't allocate can check that it didn't (see
+   check_no_allocs). Each thread has its own count, so no two threads
+   ever write to the same counter, and one thread's allocations never
+   show up in another's check. */
+__thread long num_allocs = 0;
+
 /* To reduce the need for error checking code elsewhere in the
    program, this wrapper around malloc() will print an error message
    and then exit the program if an allocation fails. */
 void *xmalloc(size_t size) {
     void *p = malloc(size);
+    num_allocs++;
     if (!p) {
         fprintf(stderr, "Out of memory in allocation of %zd bytes\n", size);
         exit(1);
@@ -62,23 +79,65 @@ uint64_t read_u64_bigendian(FILE *fh) {
     return x;
 }
 
+/* Largest width or height accepted for a BCFLAT image; defined with
+   the BCFLAT code. */
+extern long size_limit;
+
+/* Offsets of the start of each compressed row in a BCFLAT image, if
+   it had an RIDX tag, or a null pointer otherwise. There is one entry
+   for each row of each channel, in the same order as the rows are
+   stored in the file, plus a final entry for the end of the
+   compressed data. Offsets count from the first byte after the DATA
+   tag. */
+long *flat_row_index = 0;
+
+/* CRC32C of the image data, everything after the DATA tag to the end
+   of the file, from a DCRC tag, or -1 if the image didn't have one.
+   Decoders that read all of the data check it as they go. */
+long data_crc = -1;
+
 /* Printf format to log information about each displayed image */
 const char *logging_fmt = "Displaying image of width %ld and height %ld"
     " from %s";
 
+/* Convert the "num_entries" big-endian 64-bit offsets of an RIDX tag
+   at "bytes" into flat_row_index, which must already have room for
+   them. "bytes" may be flat_row_index itself, since each entry is
+   converted before anything is stored over its bytes. Returns 1 on
+   success, or 0 after setting format_problem. */
+int convert_flat_row_index(const unsigned char *bytes, long num_entries) {
+    long i;
+    for (i = 0; i < num_entries; i++) {
+        uint64_t x = 0;
+        int j;
+        for (j = 0; j < 8; j++)
+            x = (x << 8) | bytes[8 * i + j];
+        if (x > (1LL << 40)) {
+            format_problem = "row offset too large";
+            return 0;
+        }
+        flat_row_index[i] = x;
+    }
+    return 1;
+}
+
 /* The tagged-data section of a Badly Coded image file contains
    optional information of various kinds: each kind of data is
    preceeded by a 4-byte type identifier and an 8-byte size (which
    counts bytes after the type identifier and size). A type identifier
    "DATA" represents the end of the tagged-data section, and is
-   followed directly by the image data without another size. The
-   function reads this region of a file, returning 1 if the format was
-   correct or 0 if there was an error. */
-int process_tagged_data(FILE *fh, struct image_info *info) {
+   followed directly by the image data without another size. Some
+   tags only make sense in some formats, so "magic" is the magic
+   number of the file's format. The function reads this region of a
+   file, returning 1 if the format was correct or 0 if there was an
+   error. */
+int process_tagged_data(FILE *fh, struct image_info *info,
+                        const unsigned char *magic) {
     unsigned char ident[4];
     unsigned long size;
     size_t num_read;
 
+    data_crc = -1;
     for (;;) {
         num_read = fread(ident, 4, 1, fh);
         if (num_read != 1) {
@@ -106,6 +165,34 @@ int process_tagged_data(FILE *fh, struct image_info *info) {
                 return 0;
             }
             info->create_time = read_u64_bigendian(fh);
+        } else if (!memcmp(ident, "DCRC", 4)) {
+            /* Checksum of the image data, as a 64-bit number */
+            uint64_t crc;
+            if (size != 8) {
+                format_problem = "wrong size for DCRC";
+                return 0;
+            }
+            crc = read_u64_bigendian(fh);
+            if (crc > 0xffffffff) {
+                format_problem = "bad DCRC";
+                return 0;
+            }
+            data_crc = crc;
+        } else if (!memcmp(ident, "THMB", 4)) {
+            /* A thumbnail of the image, which is only read by
+               parse_thumbnail, so decoding the image skips it. It is
+               read and thrown away rather than seeked over, since
+               the image might be coming from a pipe. */
+            unsigned char skipped[4096];
+            while (size > 0) {
+                size_t num = size < sizeof(skipped) ? size
+                    : sizeof(skipped);
+                if (fread(skipped, 1, num, fh) != num) {
+                    format_problem = "short read of THMB";
+                    return 0;
+                }
+                size -= num;
+            }
         } else if (!memcmp(ident, "FRMT", 4)) {
             /* Format for file information printing */
             char *fmt_buf = xmalloc(size + 1);
@@ -117,8 +204,31 @@ int process_tagged_data(FILE *fh, struct image_info *info) {
             /* Add null terminator */
             fmt_buf[size] = 0;
             logging_fmt = fmt_buf;
+        } else if (!memcmp(ident, "RIDX", 4)
+                   && !memcmp(magic, bcflat_magic, 8)) {
+            /* Row index for parallel or partial BCFLAT decoding: a
+               big-endian 64-bit offset for each channel row, plus
+               one for the end of the data */
+            long num_entries = 3 * info->height + 1;
+            if (info->height > size_limit || size != 8 * num_entries) {
+                format_problem = "wrong size for RIDX";
+                return 0;
+            }
+            free(flat_row_index);
+            flat_row_index = xmalloc(size);
+            /* Read all the entries at once, and then convert them in
+               place */
+            num_read = fread(flat_row_index, 1, size, fh);
+            if (num_read != size) {
+                format_problem = "short read of RIDX";
+                return 0;
+            }
+            if (!convert_flat_row_index((unsigned char *)flat_row_index,
+                                        num_entries))
+                return 0;
         } else {
-            /* An unrecognized tag is an error. */
+            /* An unrecognized tag is an error, as is a row index in
+               any format other than BCFLAT. */
             format_problem = "unrecognized tag";
             return 0;
         }
@@ -126,35 +236,170 @@ int process_tagged_data(FILE *fh, struct image_info *info) {
     
 }
 
-/* Read the pixel data from a BCRAW image into the internal
-   format. For the sake of 8-byte alignment, 8 contiguous pixels (24
-   bytes) are read as a single unit. Returns 1 on success, or 0 for an
-   error such as a short read.  */
-int read_raw_data(FILE *fh, struct image_info *info) {
-    int row, col;
-    size_t num_read;
-    unsigned char *p = info->pixels;
+/* The DCRC checksum is CRC32C (the Castagnoli polynomial, as used by
+   iSCSI and ext4), which newer x86 processors compute with the SSE4.2
+   crc32 instruction, 8 bytes at a time. Elsewhere it is computed with
+   eight tables of 256 entries, also 8 bytes at a time ("slicing by
+   8"): crc32c_table[k][b] is the effect of byte b followed by k zero
+   bytes. */
+uint32_t crc32c_table[8][256];
+
+/* Fill in crc32c_table, if that hasn't been done already. */
+void init_crc32c(void) {
+    static int initialized;
+    uint32_t i;
+    int j, k;
+    if (initialized)
+        return;
+    for (i = 0; i < 256; i++) {
+        uint32_t crc = i;
+        for (j = 0; j < 8; j++)
+            crc = (crc >> 1) ^ (crc & 1 ? 0x82f63b78 : 0);
+        crc32c_table[0][i] = crc;
+    }
+    for (k = 1; k < 8; k++) {
+        for (i = 0; i < 256; i++) {
+            uint32_t crc = crc32c_table[k - 1][i];
+            crc32c_table[k][i] = (crc >> 8) ^ crc32c_table[0][crc & 0xff];
+        }
+    }
+    initialized = 1;
+}
 
-    for (row = 0; row < info->height; row++) {
-        for (col = 0; col < info->width - 8; col += 8) {
-            num_read = fread(p, 3, 8, fh);
-            if (num_read != 8) {
-                format_problem = "short read of raw data";
-                return 0;
-            }
-            p += 3*8;
+/* Continue the CRC32C "crc" of some data with the "n" bytes at "p",
+   using the tables. The CRC of no data is 0. */
+uint32_t crc32c_scalar(uint32_t crc, const unsigned char *p, long n) {
+    init_crc32c();
+    crc = ~crc;
+    for (; n >= 8; n -= 8, p += 8) {
+        uint32_t lo = crc ^ (p[0] | p[1] << 8 | p[2] << 16
+                             | (uint32_t)p[3] << 24);
+        crc = crc32c_table[7][lo & 0xff] ^ crc32c_table[6][(lo >> 8) & 0xff]
+            ^ crc32c_table[5][(lo >> 16) & 0xff] ^ crc32c_table[4][lo >> 24]
+            ^ crc32c_table[3][p[4]] ^ crc32c_table[2][p[5]]
+            ^ crc32c_table[1][p[6]] ^ crc32c_table[0][p[7]];
+    }
+    for (; n > 0; n--, p++)
+        crc = (crc >> 8) ^ crc32c_table[0][(crc ^ *p) & 0xff];
+    return ~crc;
+}
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+/* SSE4.2 version of crc32c_scalar. */
+__attribute__((target("sse4.2")))
+uint32_t crc32c_sse42(uint32_t crc, const unsigned char *p, long n) {
+    crc = ~crc;
+#ifdef __x86_64__
+    for (; n >= 8; n -= 8, p += 8) {
+        uint64_t word;
+        memcpy(&word, p, 8);
+        crc = _mm_crc32_u64(crc, word);
+    }
+#else
+    for (; n >= 4; n -= 4, p += 4) {
+        uint32_t word;
+        memcpy(&word, p, 4);
+        crc = _mm_crc32_u32(crc, word);
+    }
+#endif
+    for (; n > 0; n--, p++)
+        crc = _mm_crc32_u8(crc, *p);
+    return ~crc;
+}
+#endif
+
+/* Dispatcher for the functions above, using the crc32 instruction if
+   the processor supports it. */
+uint32_t crc32c(uint32_t crc, const unsigned char *p, long n) {
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+    if (__builtin_cpu_supports("sse4.2"))
+        return crc32c_sse42(crc, p, n);
+#endif
+    return crc32c_scalar(crc, p, n);
+}
+
+/* Multiply "a" and "b" as polynomials modulo the CRC32C polynomial,
+   in the bit-reversed order CRCs are kept in, where the top bit is
+   the x^0 term. */
+uint32_t crc32c_multiply(uint32_t a, uint32_t b) {
+    uint32_t m = (uint32_t)1 << 31, product = 0;
+    for (; m && a; m >>= 1) {
+        if (a & m) {
+            product ^= b;
+            a ^= m;
         }
+        b = (b >> 1) ^ (b & 1 ? 0x82f63b78 : 0);
+    }
+    return product;
+}
 
-        /* This loop covers any pixels in a row left over after the
-           24-byte groups */
-        for (; col < info->width; col++) {
-            num_read = fread(p, 3, 1, fh);
-            if (num_read != 1) {
+/* Combine the CRC32C "crc1" of some data with the CRC32C "crc2" of the
+   "len2" bytes that follow it, giving the CRC32C of both together, as
+   zlib's crc32_combine does. Appending len2 bytes multiplies the
+   first CRC by x^(8 * len2), which is built up from x^(2^k) by
+   repeated squaring, so this takes time proportional to log(len2). */
+uint32_t crc32c_combine(uint32_t crc1, uint32_t crc2, long len2) {
+    uint32_t power = (uint32_t)1 << 23;    /* x^8, for one byte */
+    uint32_t shift = (uint32_t)1 << 31;    /* x^0 */
+    for (; len2 > 0; len2 >>= 1) {
+        if (len2 & 1)
+            shift = crc32c_multiply(shift, power);
+        power = crc32c_multiply(power, power);
+    }
+    return crc32c_multiply(shift, crc1) ^ crc2;
+}
+
+/* Finish checking the image data against data_crc, given the CRC
+   "crc" of the data read from "fh" so far, by reading the rest of the
+   file. Returns 1 if they match, or 0 after setting format_problem. */
+int finish_data_crc(FILE *fh, uint32_t crc) {
+    unsigned char buf[4096];
+    size_t num_read;
+    do {
+        num_read = fread(buf, 1, sizeof(buf), fh);
+        crc = crc32c(crc, buf, num_read);
+    } while (num_read == sizeof(buf));
+    if (ferror(fh)) {
+        format_problem = "short read";
+        return 0;
+    }
+    if (crc != data_crc) {
+        format_problem = "checksum mismatch";
+        return 0;
+    }
+    return 1;
+}
+
+/* Read the pixel data from a BCRAW image into the internal format.
+   The body of a BCRAW file is laid out exactly like our pixels in
+   memory, so all of the rows are read with a single fread, which for
+   a large image lets the C library read straight into the pixel
+   buffer. With a DCRC tag, the pixels are instead read in pieces that
+   are checksummed while they are still in the cache. Returns 1 on
+   success, or 0 for an error such as a short read. */
+int read_raw_data(FILE *fh, struct image_info *info) {
+    size_t num_read;
+
+    if (data_crc != -1) {
+        long size = 3 * info->width * info->height, pos = 0;
+        uint32_t crc = 0;
+        while (pos < size) {
+            long num = size - pos < 65536 ? size - pos : 65536;
+            if (fread(info->pixels + pos, 1, num, fh) != num) {
                 format_problem = "short read of raw data";
                 return 0;
             }
-            p += 3;
+            crc = crc32c(crc, info->pixels + pos, num);
+            pos += num;
         }
+        return finish_data_crc(fh, crc);
+    }
+    if (info->width == 0 || info->height == 0)
+        return 1;
+    num_read = fread(info->pixels, 3 * info->width, info->height, fh);
+    if (num_read != info->height) {
+        format_problem = "short read of raw data";
+        return 0;
     }
     return 1;
 }
@@ -178,6 +423,22 @@ struct image_info *trailer_location(unsigned char *base, size_t pixel_bytes) {
     return (struct image_info *)(trailer_loc + pad);
 }
 
+/* Check the flags of a BCRAW image. Returns 1 if they are valid, or
+   0 after setting format_problem. */
+int check_bcraw_flags(const unsigned char *flags) {
+    if (flags[0] != 0 || flags[1] != 0 || flags[2] != 0 || flags[3] != 0 ||
+        flags[4] != 0 || flags[5] != 0 || flags[6] != 0) {
+        format_problem = "reserved flags should be 0";
+        return 0;
+    }
+
+    if (flags[7] != 8) {
+        format_problem = "unsupported depth";
+        return 0; /* format should be 8, for 8 bit-deep RGB */
+    }
+    return 1;
+}
+
 /* Read a BCRAW image from a file into our internal format. Only the
    magic number should have been read before calling this
    routine. Returns a pointer to an image_info structure representing
@@ -196,16 +457,8 @@ struct image_info *parse_bcraw(FILE *fh) {
         return 0;
     }
 
-    if (flags[0] != 0 || flags[1] != 0 || flags[2] != 0 || flags[3] != 0 ||
-        flags[4] != 0 || flags[5] != 0 || flags[6] != 0) {
-        format_problem = "reserved flags should be 0";
+    if (!check_bcraw_flags(flags))
         return 0;
-    }
-
-    if (flags[7] != 8) {
-        format_problem = "unsupported depth";
-        return 0; /* format should be 8, for 8 bit-deep RGB */
-    }
 
     width = read_u64_bigendian(fh);
     if (width == -1) return 0;
@@ -223,7 +476,7 @@ struct image_info *parse_bcraw(FILE *fh) {
     info_footer->create_time = -1;
     info_footer->cleanup = 0;
 
-    is_ok = process_tagged_data(fh, info_footer);
+    is_ok = process_tagged_data(fh, info_footer, bcraw_magic);
     if (!is_ok) {
         free(pixels);
         return 0;
@@ -245,15 +498,47 @@ struct image_info *parse_bcraw(FILE *fh) {
     return info;
 }
 
+/* Expand a row of "width" packed BCPROG pixels at the start of
+   "row_p" in place into 24-bit pixels. Returns 1 on success, or 0
+   after setting format_problem for a byte outside the palette. */
+int expand_prog_row(unsigned char *row_p, long width) {
+    long col;
+    /* This loop needs to run backwards because the decoding expands
+       the pixel data. */
+    for (col = width - 1; col >= 0; col--) {
+        unsigned char packed = row_p[col];
+        int r, g, b;
+        if (packed >= 216) {
+            format_problem = "invalid packed byte";
+            return 0;
+        }
+        /* A number between 0 and 6**3-1 is interpreted like a number
+           in base 6, where the three digits represent the red, blue,
+           and green components. Digits between 0 and 5 are scaled by
+           51 to 8-bit samples between 0 and 255. */
+        b = packed % 6;
+        packed /= 6;
+        g = packed % 6;
+        packed /= 6;
+        r = packed;
+        row_p[3 * col] = 51 * r;
+        row_p[3 * col + 1] = 51 * g;
+        row_p[3 * col + 2] = 51 * b;
+    }
+    return 1;
+}
+
 /* Read and transform the image data from a BCPROG file into our
    internal format. This happens in two steps. First, as the rows are
    being read, they are re-ordered from the progressive on-disk order
    into a normal sequential order. Then, the pixels in each row are
-   expanded from the 8-bit format to 24-bit format. */
+   expanded from the 8-bit format to 24-bit format. With a DCRC tag,
+   each row is checksummed as it is read. */
 int read_prog_data(FILE *fh, struct image_info *info) {
-    int row, col;
+    int row;
     size_t num_read;
     unsigned char *p = info->pixels;
+    uint32_t crc = 0;
 
     /* Step 1: decode progressive row ordering to sequential */
     /* Pass 1: multiples of 4 */
@@ -265,6 +550,8 @@ int read_prog_data(FILE *fh, struct image_info *info) {
             format_problem = "short read of row";
             return 0;
         }
+        if (data_crc != -1)
+            crc = crc32c(crc, row_start, info->width);
         row += 4;
     } while (row < info->height);
     /* Pass 2: odd multiples of 2 */
@@ -276,6 +563,8 @@ int read_prog_data(FILE *fh, struct image_info *info) {
             format_problem = "short read of row";
             return 0;
         }
+        if (data_crc != -1)
+            crc = crc32c(crc, row_start, info->width);
         row += 4;
     } while (row < info->height);
     /* Pass 3: rows */
@@ -287,34 +576,17 @@ int read_prog_data(FILE *fh, struct image_info *info) {
             format_problem = "short read of row";
             return 0;
         }
+        if (data_crc != -1)
+            crc = crc32c(crc, row_start, info->width);
         row += 2;
     } while (row < info->height);
+    if (data_crc != -1 && !finish_data_crc(fh, crc))
+        return 0;
 
     /* Step 2: decode 8-bit palette to 24-bit color */
     for (row = 0; row < info->height; row++) {
-        /* This inner loop needs to run backwards because the decoding
-           expands the pixel data. */
-        unsigned char *row_p = p + row * 3 * info->width;
-        for (col = info->width - 1; col >= 0; col--) {
-            unsigned char packed = row_p[col];
-            int r, g, b;
-            if (packed >= 216) {
-                format_problem = "invalid packed byte";
-                return 0;
-            }
-            /* A number between 0 and 6**3-1 is interpreted like a
-               number in base 6, where the three digits represent the
-               red, blue, and green components. Digits between 0 and 5
-               are scaled by 51 to 8-bit samples between 0 and 255. */
-            b = packed % 6;
-            packed /= 6;
-            g = packed % 6;
-            packed /= 6;
-            r = packed;
-            row_p[3 * col] = 51 * r;
-            row_p[3 * col + 1] = 51 * g;
-            row_p[3 * col + 2] = 51 * b;
-        }
+        if (!expand_prog_row(p + row * 3 * info->width, info->width))
+            return 0;
     }
     return 1;
 }
@@ -379,7 +651,7 @@ struct image_info *parse_bcprog(FILE *fh) {
     info_footer->create_time = -1;
     info_footer->cleanup = 0;
 
-    is_ok = process_tagged_data(fh, info_footer);
+    is_ok = process_tagged_data(fh, info_footer, bcprog_magic);
     if (!is_ok) {
         free(pixels);
         return 0;
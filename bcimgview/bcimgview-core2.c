@@ -1,16 +1,21 @@
 #include "bcimgview-core1"
 
-/* Compressed data from a BCFLAT file is buffered up to FLATBUF (100)
-   bytes at once. The compressed data is variable-length, so we can't
-   tell how much to read for each row in advance. 100 bytes is a
-   compromise between not having to do too many short reads, and not
-   wasting too much time moving data down in the buffer. (We could
-   save data movement in the buffer by using circular indexing, but
-   that would make the code more complex.) To decide how much space to
-   keep for uncompressed data, we need to keep track of the maximum
-   factor by which the size of data can increase as it is
-   decompressed. */
-#define FLATBUF 100
+/* Compressed data from a BCFLAT file is read through an input buffer
+   of FLAT_INPUT_SIZE (64KiB) bytes. The compressed data is
+   variable-length, so we can't tell how much to read for each row in
+   advance. Instead the decoder works directly on whatever is in the
+   buffer, and the buffer is only refilled once fewer than
+   FLAT_MIN_INPUT bytes are left: the few unconsumed bytes are moved
+   down to the start of the buffer and the rest is filled with one
+   large read. So data moves at most once per 64KiB, rather than after
+   every call to the decoder. The buffer is followed by FLAT_PAD bytes
+   of zero padding, so the decoder can look a little past the end of
+   the data without reading undefined memory. To decide how much
+   space to keep for uncompressed data, we need to keep track of the
+   maximum number of samples that one codeword can expand to. */
+#define FLAT_INPUT_SIZE (64 * 1024)
+#define FLAT_MIN_INPUT 16
+#define FLAT_PAD 8
 #define EXPANSION 8
 
 /* In the BCFLAT image format, each sample after the first in a row is
@@ -18,20 +23,194 @@
    differences are encoded with codewords that range from 3 to 13 bits
    long, and represent 1-8 bytes each. Because most other operations
    on data use 8-bit words, we need a buffer to hold bits that were
-   left over from a previous codeword. It's easiest if this buffer can
-   hold at least (13 - 1) + 8 = 24 bits, so 32 bits is enough; we
-   assume an int holds at least 32 bits. This buffer is managed
-   somewhat like a shift register in that the next bits to parse are
-   at the most significant position; bits move left through the
-   register as they are processed. "reg" represents the register
-   contents, while "reg_size" keeps track of how many positions are in
-   use. */
+   left over from a previous codeword. We use a 64-bit buffer, which
+   is refilled with as many whole bytes as fit (7 or 8 at once) using
+   a single unaligned load, so that at least 56 bits, enough for four
+   of the longest codewords, are available between refills. This
+   buffer is managed somewhat like a shift register in that the next
+   bits to parse are at the most significant position; bits move left
+   through the register as they are processed. "reg" represents the
+   register contents, while "reg_size" keeps track of how many
+   positions are in use. */
 struct flat_decode_state {
-    unsigned int reg;   /* shift register of codeword bits */
+    uint64_t reg;       /* shift register of codeword bits */
     int reg_size;       /* number of bits in the register */
     unsigned char last; /* previous pixel value */
 };
 
+/* Load the 8 bytes starting at "p" (which need not be aligned) as a
+   big-endian number, so that the first byte ends up in the most
+   significant position, just like the bits in the shift register. */
+static inline uint64_t load_u64_bigendian(const unsigned char *p) {
+#if defined(__GNUC__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    uint64_t x;
+    memcpy(&x, p, 8);
+    return __builtin_bswap64(x);
+#else
+    uint64_t x = 0;
+    int i;
+    for (i = 0; i < 8; i++)
+        x = (x << 8) | p[i];
+    return x;
+#endif
+}
+
+/* Store "x" as 8 bytes starting at "p" (which need not be aligned),
+   most significant byte first; the opposite of load_u64_bigendian. */
+static inline void store_u64_bigendian(unsigned char *p, uint64_t x) {
+#if defined(__GNUC__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    x = __builtin_bswap64(x);
+    memcpy(p, &x, 8);
+#else
+    int i;
+    for (i = 7; i >= 0; i--) {
+        p[i] = x & 0xff;
+        x >>= 8;
+    }
+#endif
+}
+
+/* Input stage for BCFLAT compressed data. The bytes from "pos" up to
+   "end" of "buf" have been read from "fh" but not yet consumed by the
+   decoder. */
+struct flat_input {
+    FILE *fh;
+    unsigned char *buf; /* FLAT_INPUT_SIZE bytes, plus FLAT_PAD padding */
+    int pos;            /* next unconsumed byte */
+    int end;            /* end of the data read so far */
+    int at_eof;         /* set once fh has no more data */
+    int check_crc;      /* FLAT_CRC_READ, FLAT_CRC_CONSUMED, or 0 */
+    uint32_t crc;       /* CRC32C of the data so far */
+};
+
+/* Ways an input stage can checksum its data: everything read from
+   the file, or only the bytes the decoder has consumed, which the
+   caller finishes off with consumed_flat_crc. */
+#define FLAT_CRC_READ 1
+#define FLAT_CRC_CONSUMED 2
+
+/* Prepare an input stage to read compressed data from "fh", dropping
+   anything left over from a previous image. If "check_crc" is set
+   and the image has a DCRC tag, each piece of data is added to a
+   checksum: with FLAT_CRC_READ, as it is read, for finish_flat_input
+   to check, which only makes sense for decoders that read all of the
+   data; with FLAT_CRC_CONSUMED, as the decoder finishes with it, for
+   a decoder reading one part of the data. */
+void start_flat_input(struct flat_input *in, FILE *fh, int check_crc) {
+    in->fh = fh;
+    in->pos = 0;
+    in->end = 0;
+    in->at_eof = 0;
+    in->check_crc = data_crc != -1 ? check_crc : 0;
+    in->crc = 0;
+    memset(in->buf, 0, FLAT_PAD);
+}
+
+/* Refill the input buffer if fewer than FLAT_MIN_INPUT unconsumed
+   bytes are left in it and the file has more data. Returns 1 on
+   success, or 0 on a read error. */
+int fill_flat_input(struct flat_input *in) {
+    int avail = in->end - in->pos;
+    int num_to_read;
+    size_t num_read;
+    if (avail >= FLAT_MIN_INPUT || in->at_eof)
+        return 1;
+    /* memmove is similar to memcpy, but it is particularly guaranteed
+       to work correctly when the source and destination regions might
+       overlap, as they can do when moving data down a buffer. */
+    if (in->check_crc == FLAT_CRC_CONSUMED)
+        in->crc = crc32c(in->crc, in->buf, in->pos);
+    memmove(in->buf, in->buf + in->pos, avail);
+    in->pos = 0;
+    in->end = avail;
+    num_to_read = FLAT_INPUT_SIZE - avail;
+    num_read = fread(in->buf + avail, 1, num_to_read, in->fh);
+    if (num_read < num_to_read) {
+        if (!feof(in->fh)) {
+            format_problem = "short read";
+            return 0;
+        }
+        in->at_eof = 1;
+    }
+    if (in->check_crc == FLAT_CRC_READ)
+        in->crc = crc32c(in->crc, in->buf + avail, num_read);
+    in->end += num_read;
+    memset(in->buf + in->end, 0, FLAT_PAD);
+    return 1;
+}
+
+/* Read the rest of the file through an input stage, so that its
+   checksum covers it. Returns 1 on success, or 0 after setting
+   format_problem. */
+int drain_flat_input(struct flat_input *in) {
+    while (!in->at_eof) {
+        in->pos = in->end;
+        if (!fill_flat_input(in))
+            return 0;
+    }
+    return 1;
+}
+
+/* The checksum of the bytes a decoder has consumed from an input
+   stage started with FLAT_CRC_CONSUMED. */
+uint32_t consumed_flat_crc(const struct flat_input *in) {
+    return crc32c(in->crc, in->buf, in->pos);
+}
+
+/* After a decoder has finished with an input stage, check the data
+   against the DCRC tag if start_flat_input arranged to. The checksum
+   covers the whole rest of the file, so anything after the image is
+   read through the buffer first. Returns 1 on success, or 0 after
+   setting format_problem. */
+int finish_flat_input(struct flat_input *in) {
+    if (!in->check_crc)
+        return 1;
+    if (!drain_flat_input(in))
+        return 0;
+    if (in->crc != data_crc) {
+        format_problem = "checksum mismatch";
+        return 0;
+    }
+    return 1;
+}
+
+/* Memory used by the BCFLAT decoder. Rather than allocating it for
+   every image or every call to decode_flat, one input stage is
+   allocated the first time a BCFLAT image is read and then reused for
+   every row of every later image, so decoding itself never touches
+   the heap. Samples are decoded straight into the image, so the only
+   memory it needs is the input buffer.
+
+   Because there is only one, the readers that use it
+   (read_flat_data_sequential, read_flat_data_variant,
+   read_flat_rows_scanned and validate_flat_data) each take it over
+   for a whole image. They can't be called from more than one thread
+   at once, or from inside one another; the row stream and the push
+   decoder have input stages of their own for this reason. */
+struct flat_input *get_flat_input(void) {
+    static struct flat_input *in;
+    if (!in) {
+        in = xmalloc(sizeof(struct flat_input));
+        in->buf = xmalloc(FLAT_INPUT_SIZE + FLAT_PAD);
+    }
+    return in;
+}
+
+/* The decoding loops make no heap allocations: everything they need
+   is allocated before they start. Each of them checks this after
+   decoding, by comparing the current thread's num_allocs with what
+   it was before the loop, "allocs_before". An allocation would be a
+   bug in the decoder named "decoder" rather than a problem with the
+   image, so it stops the program; unlike an assert, the check is
+   made in every build. */
+void check_no_allocs(long allocs_before, const char *decoder) {
+    if (num_allocs != allocs_before) {
+        fprintf(stderr, "Internal error: %s allocated memory while"
+                " decoding\n", decoder);
+        abort();
+    }
+}
+
 /* Summary of BCFLAT codewords:
 
    000            2 samples: 0, 0        expansion 5.33
@@ -40,6 +219,7 @@ struct flat_decode_state {
    0011100        5 samples, all 0       expansion 5.71
    0011101        6 samples, all 0       expansion 6.86
    0011110        7 samples, all 0       expansion 8
+   0011111        8 samples, all 0       expansion 9.14
 
    0100xx         2 samples, +1..+4 x2   expansion 2.66
    0101xx         2 samples, -1..-4 x2   expansion 2.66
@@ -68,210 +248,377 @@ struct flat_decode_state {
    decoded without delimiters.
 */
 
+/* Everything the decoder needs to know about one codeword: how many
+   bits long it is, how many samples it represents, and the difference
+   that is added to the previous sample to produce each of them (all
+   the samples from one codeword share the same difference). */
+struct flat_code {
+    unsigned char codelen; /* length of the codeword in bits */
+    unsigned char num;     /* number of samples produced */
+    signed char diff;      /* difference applied for each sample */
+};
+
+/* Because the longest codeword is 13 bits, the top 13 bits of the
+   shift register are always enough to identify the next codeword.
+   This table maps every possible 13-bit value to the codeword that
+   starts it, so that decoding a codeword is a single lookup rather
+   than a tree of branches. At 3 bytes per entry the whole table is
+   24KiB, small enough to stay in the L1 cache during decoding. */
+#define FLAT_CODE_BITS 13
+struct flat_code flat_codes[1 << FLAT_CODE_BITS];
+
+/* Work out which codeword the 13 bits in "bits" start with. This is
+   the same tree of cases as in the table of codewords above, and is
+   only used to fill in flat_codes. */
+void classify_flat_code(unsigned int bits, struct flat_code *code) {
+    /* Line the bits up at the top of a 32-bit word, as they would be
+       in the shift register */
+    unsigned int reg = bits << (32 - FLAT_CODE_BITS);
+    if ((reg & 0xc0000000) == 0) {
+        /* 00... repeated 0 differences, i.e. repeated pixel */
+        code->diff = 0;
+        if ((reg & 0xe0000000) == 0) {
+            /* 000 */
+            code->num = 2;
+            code->codelen = 3;
+        } else if ((reg & 0xf0000000) == 0x20000000) {
+            /* 0010 */
+            code->num = 3;
+            code->codelen = 4;
+        } else if ((reg & 0xf8000000) == 0x30000000) {
+            /* 00110 */
+            code->num = 4;
+            code->codelen = 5;
+        } else {
+            /* 00111xx */
+            assert((reg & 0xf8000000) == 0x38000000);
+            code->num = 5 + ((reg >> 25) & 3);
+            code->codelen = 7;
+        }
+    } else if ((reg & 0xc0000000) == 0x40000000) {
+        /* 01... repeated small differences */
+        int amt = (reg & 0x0c000000) >> 26;
+        code->codelen = 6;
+        code->num = (reg & 0x20000000) ? 3 : 2;
+        if (reg & 0x10000000) {
+            code->diff = -4 + amt;
+        } else {
+            code->diff = 1 + amt;
+        }
+    } else {
+        /* 1... one sample difference */
+        code->num = 1;
+        if ((reg & 0xe0000000) == 0x80000000) {
+            /* 100 */
+            code->diff = 0;
+            code->codelen = 3;
+        } else if ((reg & 0xe0000000) == 0xa0000000) {
+            /* 1010 or 1011 */
+            code->codelen = 4;
+            code->diff = ((reg & 0xf0000000) == 0xa0000000) ? 1 : -1;
+        } else if ((reg & 0xf0000000) == 0xc0000000) {
+            /* 1100xy */
+            int diffs[4] = {2, 3, -3, -2};
+            code->codelen = 6;
+            code->diff = diffs[(reg & 0x0c000000) >> 26];
+        } else if ((reg & 0xf0000000) == 0xd0000000) {
+            /* 1101xyy */
+            int diffs[8] = {4, 5, 6, 7, -7, -6, -5, -4};
+            code->codelen = 7;
+            code->diff = diffs[(reg & 0x0e000000) >> 25];
+        } else if ((reg & 0xf0000000) == 0xe0000000) {
+            /* 1110... larger signed differences */
+            int subtype = (reg & 0x0e000000) >> 25;
+            int mask = (1 << (3 + (subtype >> 1))) - 1;
+            int pos = 22 - (subtype >> 1);
+            int amt = (reg >> pos) & mask;
+            int bases[8] = {8, -15, 16, -31, 32, -63, 64, -127};
+            code->codelen = 10 + (subtype >> 1);
+            code->diff = bases[subtype] + amt;
+        } else {
+            /* 1111000: +/- 128 */
+            /* other 1111xxx values reserved, decoded the same for now */
+            code->codelen = 7;
+            code->diff = -128;
+        }
+    }
+}
+
+/* When only the lengths of rows matter, several codewords can be
+   skipped at once. flat_scan_codes is indexed the same way as
+   flat_codes, but each entry covers all of the codewords that fit
+   completely in the 13 bits, with their total length and number of
+   samples (and no difference). */
+struct flat_code flat_scan_codes[1 << FLAT_CODE_BITS];
+
+/* Fill in the flat_codes and flat_scan_codes tables, if that hasn't
+   been done already. */
+void init_flat_codes(void) {
+    static int initialized;
+    unsigned int bits;
+    if (initialized)
+        return;
+    for (bits = 0; bits < (1 << FLAT_CODE_BITS); bits++) {
+        classify_flat_code(bits, &flat_codes[bits]);
+    }
+    for (bits = 0; bits < (1 << FLAT_CODE_BITS); bits++) {
+        struct flat_code *scan = &flat_scan_codes[bits];
+        scan->codelen = 0;
+        scan->num = 0;
+        scan->diff = 0;
+        for (;;) {
+            unsigned int rest = (bits << scan->codelen)
+                & ((1 << FLAT_CODE_BITS) - 1);
+            struct flat_code code;
+            classify_flat_code(rest, &code);
+            if (scan->codelen + code.codelen > FLAT_CODE_BITS)
+                break;
+            scan->codelen += code.codelen;
+            scan->num += code.num;
+        }
+    }
+    initialized = 1;
+}
+
+/* Areas of flat color are mostly long runs of zero differences,
+   which are encoded as a series of 0011111 codewords for 8 samples
+   each. This is what the shift register holds when it starts with
+   nine of them, followed by a 0 bit, so comparing against it counts
+   the run codewords without looking them up one by one. */
+#define FLAT_MAX_RUNS 0x3e7cf9f3e7cf9f3eULL
+
+/* Count how many 0011111 codewords the shift register "reg" starts
+   with, among the "reg_size" bits it holds. */
+static inline int count_max_runs(uint64_t reg, int reg_size) {
+    /* Setting the low bit stops the count at 9 */
+    uint64_t diff = (reg ^ FLAT_MAX_RUNS) | 1;
+    int n;
+#ifdef __GNUC__
+    n = __builtin_clzll(diff);
+#else
+    n = 0;
+    while (!(diff & ((uint64_t)1 << 63))) {
+        diff <<= 1;
+        n++;
+    }
+#endif
+    return (n < reg_size ? n : reg_size) / 7;
+}
+
 /* This function represents the inner loop of decoding flat-compressed
    samples. It reads compressed data from "comp_p" and writes
-   corresponding uncompressed data to "uncomp_p", updating the
-   decompression state "state" accordingly. On entrance
+   corresponding uncompressed samples to "uncomp_p", "stride" bytes
+   apart (3 when writing one channel of an interleaved row), updating
+   the decompression state "state" accordingly. On entrance
    "comp_size_inout" should point to the number of bytes of compressed
    data that comp_p points to, and on exit is updated to point to the
    number of compressed bytes consumed. On entrance pixels_inout
    should point to the maximum number of pixels that should be
    decompressed (i.e., before the end of a row), and on exit it will
-   hold the number that were actually decompressed. */
+   hold the number that were actually decompressed. The compressed
+   data must be followed by at least FLAT_PAD readable bytes, as in
+   the input buffer. The flat_codes table must have been initialized
+   with init_flat_codes(). */
 void decode_flat(unsigned char *comp_p, int *comp_size_inout,
-                 unsigned char *uncomp_p, int *pixels_inout,
+                 unsigned char *uncomp_p, int stride, int *pixels_inout,
                  struct flat_decode_state *state) {
-    /* compressed data buffer, dynamically allocated */
-    unsigned char *comp_buf;
-    /* decompressed data buffer */
-    unsigned char uncomp_buf[EXPANSION * (FLATBUF + 1)];
     unsigned char last = state->last;
-    unsigned int reg = state->reg;
-    unsigned int reg_size = state->reg_size;
-    unsigned char *p, *q;
+    uint64_t reg = state->reg;
+    int reg_size = state->reg_size;
+    unsigned char *p = comp_p, *q = uncomp_p;
+    unsigned char *comp_end = comp_p + *comp_size_inout;
     int max_pixels = *pixels_inout;
     int num_pixels = 0;
-    int comp_size = *comp_size_inout;
-    /* If non-zero, some of the bits in reg_size were from padding
-       bytes, and so should not be used for decoding. */
-    int padding_bits = 0;
-
-    /* Pad the compressed input with two extra bytes, so that we don't
-       read ahead into undefined data */
-    assert(comp_size <= FLATBUF);
-    comp_buf = xmalloc(FLATBUF + 2);
-    memcpy(comp_buf, comp_p, comp_size);
-    comp_buf[comp_size] = 0x00;
-    comp_buf[comp_size + 1] = 0x00;
-
-    p = comp_buf;
-    q = uncomp_buf;
-
-    while (num_pixels < max_pixels && p < comp_buf + comp_size + 2) {
-        int codelen;
-        assert(num_pixels >= 0);
-        /* Read compressed data into the register until we have
-           enough to cover any codeword */
-        while (reg_size < 13) {
-            /* We might read up to two bytes beyond the supplied
-               compressed data. The bits from these bytes go into the
-               shift register, but if it looks like we're about to
-               match a codeword including them, we stop. */
-            if (p >= comp_buf + comp_size)
-                padding_bits += 8;
-            reg |= (*p++) << ((32 - 8) - reg_size);
-            reg_size += 8;
-        }
-        /* The next long tree of branches covers all the different
-           possible code words. It may look intimidating, but a lot of
-           the cases are similar to one another, and you can match
-           them back up with the table of codewords in the comment
-           above. Another possibility would be to implement this with
-           a lookup table, but with 2**13 = 8182 entries it would have
-           to be pretty big itself. */
-        if ((reg & 0xc0000000) == 0) {
-            /* 00... repeated 0 differences, i.e. repeated pixel */
-            int num_zeros, i;
-            if ((reg & 0xe0000000) == 0) {
-                /* 000 */
-                num_zeros = 2;
-                codelen = 3;
-            } else if ((reg & 0xf0000000) == 0x20000000) {
-                /* 0010 */
-                num_zeros = 3;
-                codelen = 4;
-            } else if ((reg & 0xf8000000) == 0x30000000) {
-                /* 00110 */
-                num_zeros = 4;
-                codelen = 5;
-            } else if ((reg & 0xf8000000) == 0x38000000) {
-                /* 00111... */
-                num_zeros = 5 + ((reg >> 25) & 3);
-                codelen = 7;
-            } else {
-                assert(0);
-            }
-            if (codelen > (reg_size - padding_bits)) {
-                /* Don't match using padding bits */
-                break;
-            }
-            assert(num_zeros >= 2 && num_zeros <= 8);
-            for (i = 0; i < num_zeros; i++) {
-                *q++ = last;
-            }
-            num_pixels += num_zeros;
-        } else if ((reg & 0xc0000000) == 0x40000000) {
-            /* 01... repeated small differences */
-            int num, diff, amt, i;
-            codelen = 6;
-            if (codelen > (reg_size - padding_bits)) {
-                break;
-            }
-            if (reg & 0x20000000) {
-                num = 3;
-            } else {
-                num = 2;
-            }
-            amt = (reg & 0x0c000000) >> 26;
-            if (reg & 0x10000000) {
-                diff = -4 + amt;
+
+    /* Main loop: while there are at least 8 bytes of compressed data
+       left, each refill is one load without any checks, after which
+       up to four codewords can be decoded. The refill ORs in all 8
+       loaded bytes, but only counts the whole bytes that fit, so the
+       low bits of the register can hold a few bits that will be
+       counted by the next refill. Those are the same bits the next
+       load puts in the same place, so ORing them in again is
+       harmless. */
+    while (num_pixels < max_pixels && comp_end - p >= 8) {
+        int k, runs;
+        reg |= load_u64_bigendian(p) >> reg_size;
+        p += (63 - reg_size) >> 3;
+        reg_size |= 56;
+        /* Run fast path: if the register starts with a series of
+           0011111 codewords, take them all at once and fill in their
+           samples together. Checking only after each refill keeps
+           this out of the way of other data, at the cost of noticing
+           a run up to four codewords late. */
+        if (reg >> 57 == 0x1f
+            && (runs = count_max_runs(reg, reg_size)) > 1
+            && max_pixels - num_pixels >= runs * EXPANSION) {
+            int i, run = runs * EXPANSION;
+            if (stride == 1) {
+                memset(q, last, run);
+                q += run;
             } else {
-                diff = 1 + amt;
-            }
-            for (i = 0; i < num; i++) {
-                unsigned char next = last + diff;
-                *q++ = next;
-                last = next;
+                for (i = 0; i < run; i++) {
+                    *q = last;
+                    q += stride;
+                }
             }
-            num_pixels += num;
-        } else {
-            int diff;
-            assert((reg & 0x80000000) == 0x80000000);
-            /* 1... one sample difference */
-            if ((reg & 0xe0000000) == 0x80000000) {
-                /* 100 */
-                diff = 0;
-                codelen = 3;
-            } else if ((reg & 0xe0000000) == 0xa0000000) {
-                /* 1010 or 1011 */
-                codelen = 4;
-                if ((reg & 0xf0000000) == 0xa0000000) {
-                    diff = 1;
-                } else {
-                    diff = -1;
+            num_pixels += run;
+            reg <<= 7 * runs;
+            reg_size -= 7 * runs;
+            continue;
+        }
+        for (k = 0; k < 4 && num_pixels < max_pixels; k++) {
+            /* The top 13 bits of the register identify the codeword;
+               see the table of codewords above. */
+            struct flat_code code = flat_codes[reg >> (64 - FLAT_CODE_BITS)];
+            int i;
+            if (code.num <= max_pixels - num_pixels) {
+                for (i = 0; i < code.num; i++) {
+                    last += code.diff;
+                    *q = last;
+                    q += stride;
                 }
-            } else if ((reg & 0xf0000000) == 0xc0000000) {
-                /* 1100xy */
-                int diffs[4] = {2, 3, -3, -2};
-                codelen = 6;
-                diff = diffs[(reg & 0x0c000000) >> 26];
-            } else if ((reg & 0xf0000000) == 0xd0000000) {
-                /* 1101xyy */
-                int diffs[8] = {4, 5, 6, 7, -7, -6, -5, -4};
-                codelen = 7;
-                diff = diffs[(reg & 0x0e000000) >> 25];
-            } else if ((reg & 0xf0000000) == 0xe0000000) {
-                /* 1110... larger signed differences */
-                int subtype = (reg & 0x0e000000) >> 25;
-                int mask = (1 << (3 + (subtype >> 1))) - 1;
-                int pos = 22 - (subtype >> 1);
-                int amt = (reg >> pos) & mask;
-                int bases[8] = {8, -15, 16, -31, 32, -63, 64, -127};
-                codelen = 10 + (subtype >> 1);
-                assert(subtype >= 0 && subtype <= 7);
-                diff = bases[subtype] + amt;
-            } else if ((reg & 0xf0000000) == 0xf0000000) {
-                /* 1111000: +/- 128 */
-                /* other 1111xxx values reserved, decoded the same for now */
-                codelen = 7;
-                diff = -128;
-            } else {
-                assert(0);
             }
-            if (codelen > (reg_size - padding_bits)) {
-                break;
+            num_pixels += code.num;
+            /* Remove the matched codeword from the shift register by
+               shifting it off the top and decreasing the size
+               accordingly. */
+            reg <<= code.codelen;
+            reg_size -= code.codelen;
+        }
+    }
+
+    /* Tail loop, for the last few bytes of the supplied data. Refills
+       may now load padding bytes from beyond the end of the data. The
+       bits from these bytes go into the shift register, but if it
+       looks like we're about to match a codeword including them, we
+       stop. */
+    while (num_pixels < max_pixels) {
+        struct flat_code code;
+        int padding_bits, i;
+        if (reg_size < FLAT_CODE_BITS && p < comp_end) {
+            reg |= load_u64_bigendian(p) >> reg_size;
+            p += (63 - reg_size) >> 3;
+            reg_size |= 56;
+        }
+        padding_bits = p > comp_end ? 8 * (p - comp_end) : 0;
+        code = flat_codes[reg >> (64 - FLAT_CODE_BITS)];
+        if (code.codelen > reg_size - padding_bits) {
+            /* Don't match using padding bits */
+            break;
+        }
+        if (code.num <= max_pixels - num_pixels) {
+            for (i = 0; i < code.num; i++) {
+                last += code.diff;
+                *q = last;
+                q += stride;
             }
-            *q++ = last + diff;
-            last = last + diff;
-            num_pixels++;
         }
-        /* Remove the matched codeword from the shift register by
-           shifting it off the top and decreasing the size
-           accordingly. */
-        reg <<= codelen;
-        reg_size -= codelen;
+        num_pixels += code.num;
+        reg <<= code.codelen;
+        reg_size -= code.codelen;
     }
+
     /* If we've reached the end of our decoding but still have more
        than one byte's worth of bits in the shift register, "put" the
        extra bytes back so it's as if we hadn't read them in the first
        place. This is important when we get to the end of a row,
        because the next byte is the start of a new row that needs to
-       be read directly, not via the shift register. */
-    while (reg_size >= 8) {
-        reg &= ~(0xff << (32 - reg_size));
-        reg_size -= 8;
-        p--;
-    }
-    assert(q - uncomp_buf == num_pixels);
+       be read directly, not via the shift register. Any bits below
+       the ones still counted are cleared, so that the next refill can
+       OR in new bytes. Padding bytes are always among the ones put
+       back. */
+    p -= reg_size >> 3;
+    reg_size &= 7;
+    reg = reg_size ? reg & (~(uint64_t)0 << (64 - reg_size)) : 0;
+    assert(p <= comp_end);
     /* If the input is incorrectly encoded, it may produce too many
-       pixels, going beyond the end of the row. The loop above always
-       stops after the first codeword that that gets to or beyond the
+       pixels, going beyond the end of the row. The loops above always
+       stop after the first codeword that that gets to or beyond the
        end of the row. But for instance if there is supposed to be one
        pixel left, and the last codeword (incorrectly) encodes two
-       pixels, there will be an extra pixel. Up to EXPANSION number of
-       extra pixels can occur temporarily, though it will be detected
+       pixels, there will be an extra pixel. Since the samples go
+       straight into the image, the samples of such a codeword are not
+       written at all, but they are still counted, so up to EXPANSION
+       number of extra pixels can be reported. This will be detected
        as a format error by the caller. */
     assert(num_pixels <= max_pixels + EXPANSION);
-    memcpy(uncomp_p, uncomp_buf, num_pixels);
 
-    *comp_size_inout = MIN(comp_size, p - comp_buf);
-    free(comp_buf);
+    *comp_size_inout = p - comp_p;
     *pixels_inout = num_pixels;
     state->reg = reg;
     state->reg_size = reg_size;
     state->last = last;
 }
 
+/* A length-only version of decode_flat: it walks over the codewords
+   for up to *pixels_inout samples exactly as decode_flat would, and
+   with the same interface, but without producing the samples. This
+   is used to find where rows start without decoding them. */
+void scan_flat(unsigned char *comp_p, int *comp_size_inout,
+               int *pixels_inout, struct flat_decode_state *state) {
+    uint64_t reg = state->reg;
+    int reg_size = state->reg_size;
+    unsigned char *p = comp_p;
+    unsigned char *comp_end = comp_p + *comp_size_inout;
+    int max_pixels = *pixels_inout;
+    int num_pixels = 0;
+
+    while (num_pixels < max_pixels && comp_end - p >= 8) {
+        int k, runs;
+        reg |= load_u64_bigendian(p) >> reg_size;
+        p += (63 - reg_size) >> 3;
+        reg_size |= 56;
+        /* The same run fast path as in decode_flat */
+        if (reg >> 57 == 0x1f
+            && (runs = count_max_runs(reg, reg_size)) > 1
+            && max_pixels - num_pixels >= runs * EXPANSION) {
+            num_pixels += runs * EXPANSION;
+            reg <<= 7 * runs;
+            reg_size -= 7 * runs;
+            continue;
+        }
+        for (k = 0; k < 4 && num_pixels < max_pixels; k++) {
+            /* Skip all the codewords in the next 13 bits, unless that
+               could go past the end of the row. Then take just one
+               codeword, so that this stops in the same place as
+               decode_flat. */
+            struct flat_code code =
+                flat_scan_codes[reg >> (64 - FLAT_CODE_BITS)];
+            if (code.num > max_pixels - num_pixels)
+                code = flat_codes[reg >> (64 - FLAT_CODE_BITS)];
+            num_pixels += code.num;
+            reg <<= code.codelen;
+            reg_size -= code.codelen;
+        }
+    }
+    while (num_pixels < max_pixels) {
+        struct flat_code code;
+        int padding_bits;
+        if (reg_size < FLAT_CODE_BITS && p < comp_end) {
+            reg |= load_u64_bigendian(p) >> reg_size;
+            p += (63 - reg_size) >> 3;
+            reg_size |= 56;
+        }
+        padding_bits = p > comp_end ? 8 * (p - comp_end) : 0;
+        code = flat_codes[reg >> (64 - FLAT_CODE_BITS)];
+        if (code.codelen > reg_size - padding_bits)
+            break;
+        num_pixels += code.num;
+        reg <<= code.codelen;
+        reg_size -= code.codelen;
+    }
+    p -= reg_size >> 3;
+    reg_size &= 7;
+    reg = reg_size ? reg & (~(uint64_t)0 << (64 - reg_size)) : 0;
+    assert(p <= comp_end);
+    assert(num_pixels <= max_pixels + EXPANSION);
+
+    *comp_size_inout = p - comp_p;
+    *pixels_inout = num_pixels;
+    state->reg = reg;
+    state->reg_size = reg_size;
+}
+
 /* Read and decompress all the compressed samples in a BCFLAT file
    into the internal uncompressed format. A color image is stored as
    if it were a series of three grayscale images, one each for the
@@ -280,35 +627,31 @@ void decode_flat(unsigned char *comp_p, int *comp_size_inout,
    compressed separately, with the first sample of the row stored
    directly, and all subsequent samples compressed in terms of
    differences from the previous pixel. Because the compressed rows
-   have unpredictable length, all the input bytes need to pass through
-   a buffer. Since the buffer might not be long enough to hold a full
-   row of samples, the decompression state is maintained across calls
-   to decode_flat in one row. Returns 1 on success, 0 on an error. */
-int read_flat_data(FILE *fh, struct image_info *info) {
+   have unpredictable length, all the input bytes pass through the
+   decoder's input buffer. Since the buffer might not hold a full row
+   of samples at once, the decompression state is maintained across
+   calls to decode_flat in one row. Returns 1 on success, 0 on an
+   error. */
+int read_flat_data_sequential(FILE *fh, struct image_info *info) {
     int channel, y;
     struct flat_decode_state state;
-    unsigned char buf[FLATBUF];
-    unsigned char pixel_buf[3 * EXPANSION * FLATBUF];
-    int buf_read_pos = 0;
-    size_t num_read;
+    struct flat_input *in = get_flat_input();
+    long allocs_before;
+    init_flat_codes();
+    start_flat_input(in, fh, FLAT_CRC_READ);
+    allocs_before = num_allocs;
     for (channel = 0; channel <= 2; channel++) {
         for (y = 0; y < info->height; y++) {
             unsigned char *row = info->pixels + 3 * y * info->width;
             unsigned char first;
             int x = 0;
-            if (buf_read_pos > 0) {
-                /* Get the first byte already buffered */
-                first = buf[0];
-                memmove(buf, buf + 1, buf_read_pos - 1);
-                buf_read_pos--;
-            } else {
-                /* If the buffer is empty, read the first byte directly */
-                num_read = fread(&first, 1, 1, fh);
-                if (num_read != 1) {
-                    format_problem = "failed to read first byte";
-                    return 0;
-                }
+            if (!fill_flat_input(in))
+                return 0;
+            if (in->pos == in->end) {
+                format_problem = "failed to read first byte";
+                return 0;
             }
+            first = in->buf[in->pos++];
             row[0 + channel] = first;
             x++;
             /* Initialize the decompression state based on the first
@@ -320,187 +663,2435 @@ int read_flat_data(FILE *fh, struct image_info *info) {
                 /* This limit ensures we stop decoding when we get to
                    the end of the row. */
                 int max_pixels = info->width - x;
-                int comp_size, num_pixels, i;
-                if (buf_read_pos < FLATBUF) {
-                    /* If there's space in the buffer, read more
-                       data. Enough to fill the buffer, if
-                       possible. */
-                    int num_to_read = FLATBUF - buf_read_pos;
-                    num_read = fread(buf + buf_read_pos, 1, num_to_read, fh);
-                    if (num_read < num_to_read && !feof(fh)) {
-                        format_problem = "short read";
-                        return 0;
-                    }
-                    buf_read_pos += num_read;
-                }
-                comp_size = buf_read_pos;
-                if (!comp_size) {
+                int comp_size, num_pixels;
+                if (!fill_flat_input(in))
+                    return 0;
+                comp_size = in->end - in->pos;
+                num_pixels = max_pixels;
+                /* Samples are written straight into the uncompressed
+                   row. These samples of the same color are spaced
+                   every 3rd byte. */
+                decode_flat(in->buf + in->pos, &comp_size,
+                            row + 3*x + channel, 3, &num_pixels, &state);
+                if (num_pixels == 0) {
+                    /* The buffer is only this short at the end of the
+                       file, so the data stops partway through a
+                       row. */
                     format_problem = "too little data";
                     return 0;
                 }
-                num_pixels = max_pixels;
-                decode_flat(buf, &comp_size, pixel_buf, &num_pixels, &state);
-                assert(num_pixels > 0);
                 assert(num_pixels <= max_pixels + EXPANSION);
                 if (num_pixels > max_pixels) {
                     format_problem = "excess pixels at end of row";
                     return 0;
                 }
-                for (i = 0; i < num_pixels; i++) {
-                    /* Write samples into the uncompressed row. These
-                       samples of the same color are spaced every 3rd
-                       byte. */
-                    assert(x < info->width);
-                    row[3*x + channel] = pixel_buf[i];
-                    x++;
-                }
-                /* memmove is similar to memcpy, but it is
-                   particularly guaranteed to work correctly when the
-                   source and destination regions might overlap, as
-                   they can do when moving data down a buffer. */
-                memmove(buf, buf + comp_size, buf_read_pos - comp_size);
-                buf_read_pos -= comp_size;
+                x += num_pixels;
+                in->pos += comp_size;
             }
         }
     }
-    return 1;
+    /* The whole image should have been decoded using only the memory
+       the input stage already had. */
+    check_no_allocs(allocs_before, "read_flat_data_sequential");
+    return finish_flat_input(in);
 }
 
-long size_limit = 26754; /* floor(sqrt(2**31/3)) */
-
-/* Read a BCFLAT image from a file into our internal format. Only the
-   magic number should have been read before calling this
-   routine. Returns a pointer to an image_info structure representing
-   the image, or a null pointer on failure such as invalid or
-   unsupported image contents. */
-struct image_info *parse_bcflat(FILE *fh) {
-    struct image_info *info, *info_footer;
-    size_t num_read;
-    int num_bytes, is_ok;
-    long width, height;
-    unsigned char flags[8], *pixels;
+/* read_flat_data_sequential pulls its input from a file, and blocks
+   until the file has more. For input that arrives in pieces, for
+   instance from a pipe or socket, a push decoder instead takes
+   chunks of compressed data of any size as they come, decodes as
+   much of them as it can, and keeps its place in the image between
+   calls. The header and tags are read some other way first, to set
+   up the image_info. */
+struct flat_push_decoder {
+    struct image_info *info;    /* image being decoded into */
+    unsigned char *buf;         /* FLAT_INPUT_SIZE bytes, plus FLAT_PAD */
+    int end;                    /* bytes of buf not yet decoded */
+    int channel;                /* current channel, 3 when done */
+    long y, x;                  /* current row, and sample in it */
+    struct flat_decode_state state;
+    int failed;                 /* set after a format problem */
+};
 
-    num_read = fread(flags, 8, 1, fh);
-    if (num_read != 1) return 0;
+/* Create a push decoder for the compressed samples of "info", whose
+   pixels must already be allocated. */
+struct flat_push_decoder *start_flat_push(struct image_info *info) {
+    struct flat_push_decoder *d = xmalloc(sizeof(struct flat_push_decoder));
+    init_flat_codes();
+    d->info = info;
+    d->buf = xmalloc(FLAT_INPUT_SIZE + FLAT_PAD);
+    d->end = 0;
+    d->channel = 0;
+    d->y = 0;
+    d->x = 0;
+    d->failed = 0;
+    return d;
+}
 
-    if (flags[0] != 0 || flags[1] != 0 || flags[2] != 0 || flags[3] != 0 ||
-        flags[4] != 0 || flags[5] != 0) {
-        format_problem = "reserved flags should be 0";
-        return 0;
+/* Decode as much as possible of the data in the buffer, and move
+   whatever can't be decoded yet to the start. Returns 1 on success,
+   or 0 after setting format_problem. */
+int decode_flat_push_buffer(struct flat_push_decoder *d) {
+    struct image_info *info = d->info;
+    int pos = 0, is_ok = 1;
+    memset(d->buf + d->end, 0, FLAT_PAD);
+    while (d->channel <= 2) {
+        unsigned char *row = info->pixels + 3 * d->y * info->width;
+        if (d->x == 0) {
+            if (pos == d->end)
+                break;
+            row[d->channel] = d->buf[pos++];
+            d->state.last = row[d->channel];
+            d->state.reg = 0;
+            d->state.reg_size = 0;
+            d->x = 1;
+        }
+        while (d->x < info->width) {
+            int max_pixels = info->width - d->x;
+            int comp_size = d->end - pos, num_pixels = max_pixels;
+            decode_flat(d->buf + pos, &comp_size,
+                        row + 3 * d->x + d->channel, 3, &num_pixels,
+                        &d->state);
+            if (num_pixels > max_pixels) {
+                format_problem = "excess pixels at end of row";
+                is_ok = 0;
+                break;
+            }
+            pos += comp_size;
+            d->x += num_pixels;
+            if (num_pixels == 0)
+                break;  /* wait for more data */
+        }
+        if (!is_ok || d->x < info->width)
+            break;
+        d->x = 0;
+        if (++d->y == info->height) {
+            d->y = 0;
+            d->channel++;
+        }
     }
+    /* Like the other decoders, ignore anything after the image */
+    if (d->channel > 2)
+        pos = d->end;
+    memmove(d->buf, d->buf + pos, d->end - pos);
+    d->end -= pos;
+    return is_ok;
+}
 
-    if (flags[6] != 0x0d) {
-        format_problem = "unsupported dictionary size";
-        return 0; /* 0x0d = 13-bit dictionary */
+/* Give the push decoder the next "size" bytes of compressed data,
+   which may be any part of the data. After this, flat_push_rows says
+   how many rows of the image are complete. Returns 1 on success, or 0
+   after setting format_problem, after which the decoder should only
+   be passed to finish_flat_push. */
+int feed_flat_push(struct flat_push_decoder *d, const unsigned char *chunk,
+                   long size) {
+    while (size > 0) {
+        long num = FLAT_INPUT_SIZE - d->end;
+        if (num > size)
+            num = size;
+        memcpy(d->buf + d->end, chunk, num);
+        d->end += num;
+        chunk += num;
+        size -= num;
+        if (!decode_flat_push_buffer(d)) {
+            d->failed = 1;
+            return 0;
+        }
     }
+    return 1;
+}
 
-    if (flags[7] != 0x03) {
-        format_problem = "unsupported number of channels";
-        return 0; /* 0x03 = 3 channels */
+/* Number of rows of the image, from the top, that a push decoder has
+   finished. The channels come one after another, so a row is only
+   complete once its blue samples are decoded. */
+long flat_push_rows(const struct flat_push_decoder *d) {
+    if (d->channel < 2)
+        return 0;
+    return d->channel == 2 ? d->y : d->info->height;
+}
+
+/* Tell the push decoder that there is no more data, and free it.
+   Returns 1 if the whole image was decoded, or 0 if it wasn't, after
+   setting format_problem to the problem read_flat_data_sequential
+   would find (unless feed_flat_push already did). */
+int finish_flat_push(struct flat_push_decoder *d) {
+    int is_ok = !d->failed;
+    if (is_ok && d->channel <= 2) {
+        format_problem = d->x == 0 ? "failed to read first byte"
+            : "too little data";
+        is_ok = 0;
     }
+    free(d->buf);
+    free(d);
+    return is_ok;
+}
 
-    width = read_u64_bigendian(fh);
-    if (width == -1) return 0;
+/* Most of the time, the compressed data for a row can only be found
+   by decoding all the rows before it. But once a decoder knows where
+   each row starts, it can decode the rows in any order, and so in
+   parallel. For large images, read_flat_data therefore reads all the
+   compressed data into memory, makes a quick length-only pass over it
+   with scan_flat to find the start of each row, and then has a pool
+   of threads decode the rows into the image. */
 
-    height = read_u64_bigendian(fh);
-    if (height == -1) return 0;
+/* Number of threads used to decode a BCFLAT image. 0 means one per
+   online processor, and 1 means to always use the sequential
+   decoder. */
+int flat_threads = 0;
 
-    /* Size must be positive */
-    if (height < 1 || width < 1) {
-        format_problem = "size must be positive";
-        return 0;
-    }
+/* Images with fewer samples than this are always decoded
+   sequentially, since starting threads would take longer than
+   decoding. */
+#define FLAT_PARALLEL_MIN (1L << 18)
 
-    /* Sanity-check size */
-    if (height > size_limit || width > size_limit) {
-        format_problem = "size too large compared to stack";
-        return 0;
-    }
+/* Number of image rows handed to a decoding thread at once. Each task
+   covers all three channels of its rows, so different threads never
+   write to the same part of the image. */
+#define FLAT_ROWS_PER_TASK 16
 
-    num_bytes = 3 * width * height;
-    pixels = xmalloc(num_bytes +
-                     TRAILER_ALIGNMENT + sizeof(struct image_info));
-    info_footer = trailer_location(pixels, num_bytes);
-    info_footer->width = width;
-    info_footer->height = height;
-    info_footer->pixels = pixels;
-    info_footer->create_time = -1;
-    info_footer->cleanup = 0;
+/* Return the number of threads to decode BCFLAT images with. */
+int flat_thread_count(void) {
+    long n;
+    if (flat_threads > 0)
+        return flat_threads;
+    n = sysconf(_SC_NPROCESSORS_ONLN);
+    return n > 0 ? n : 1;
+}
 
-    is_ok = process_tagged_data(fh, info_footer);
-    if (!is_ok) {
-        free(pixels);
-        return 0;
-    }
+/* An upper limit on the size of one compressed row: the first sample,
+   plus a 13-bit codeword for every other sample. */
+long flat_row_limit(long width) {
+    return 1 + ((width - 1) * FLAT_CODE_BITS + 7) / 8;
+}
 
-    if (!read_flat_data(fh, info_footer)) {
-        free(pixels);
+/* Read all the remaining data from "fh" into a newly allocated buffer,
+   followed by FLAT_PAD bytes of zero padding, and store its length in
+   *size_out. If "check_crc" is set and the image has a DCRC tag, the
+   data is read FLAT_INPUT_SIZE bytes at a time and checksummed while
+   each piece is still in the cache. Returns the buffer, or a null
+   pointer on a read error or checksum mismatch. */
+unsigned char *read_flat_all(FILE *fh, int check_crc, long *size_out) {
+    long size = 0, alloc_size = FLAT_INPUT_SIZE;
+    unsigned char *data = xmalloc(alloc_size + FLAT_PAD);
+    uint32_t crc = 0;
+    check_crc = check_crc && data_crc != -1;
+    for (;;) {
+        long num_to_read = alloc_size - size;
+        size_t num_read;
+        if (check_crc && num_to_read > FLAT_INPUT_SIZE)
+            num_to_read = FLAT_INPUT_SIZE;
+        num_read = fread(data + size, 1, num_to_read, fh);
+        if (check_crc)
+            crc = crc32c(crc, data + size, num_read);
+        size += num_read;
+        if (num_read < num_to_read) {
+            if (!feof(fh)) {
+                format_problem = "short read";
+                free(data);
+                return 0;
+            }
+            break;
+        }
+        if (size < alloc_size)
+            continue;
+        alloc_size *= 2;
+        data = realloc(data, alloc_size + FLAT_PAD);
+        if (!data) {
+            fprintf(stderr, "Out of memory in allocation of %ld bytes\n",
+                    alloc_size + FLAT_PAD);
+            exit(1);
+        }
+    }
+    if (check_crc && crc != data_crc) {
+        format_problem = "checksum mismatch";
+        free(data);
         return 0;
     }
+    memset(data + size, 0, FLAT_PAD);
+    *size_out = size;
+    return data;
+}
 
-    /* Copy metadata from the footer into a new separate object */
-    info = xmalloc(sizeof(struct image_info));
-    info->width = info_footer->width;
-    info->height = info_footer->height;
-    info->create_time = info_footer->create_time;
-    info->pixels = info_footer->pixels;
-    info->cleanup = info_footer->cleanup;
-    return info;
+/* Decode or just scan one complete row of one channel, which starts
+   at "p" with "avail" bytes of data after it (and FLAT_PAD readable
+   bytes after that). If "row" is non-null, the samples are written
+   there "stride" bytes apart; otherwise the row is only scanned.
+   Returns the number of compressed bytes in the row, or -1 after
+   storing a description of the format problem in *problem. */
+long decode_flat_row(unsigned char *p, long avail, unsigned char *row,
+                     int stride, long width, const char **problem) {
+    struct flat_decode_state state;
+    int comp_size, num_pixels;
+    if (avail < 1) {
+        *problem = "failed to read first byte";
+        return -1;
+    }
+    if (width == 1) {
+        if (row)
+            row[0] = p[0];
+        return 1;
+    }
+    /* The limit on the row size keeps the size within an int, but any
+       bytes after it are still readable. */
+    comp_size = avail - 1 < flat_row_limit(width) ? avail - 1
+        : flat_row_limit(width);
+    num_pixels = width - 1;
+    state.last = p[0];
+    state.reg = 0;
+    state.reg_size = 0;
+    if (row) {
+        row[0] = p[0];
+        decode_flat(p + 1, &comp_size, row + stride, stride, &num_pixels,
+                    &state);
+    } else {
+        scan_flat(p + 1, &comp_size, &num_pixels, &state);
+    }
+    if (num_pixels < width - 1) {
+        *problem = "too little data";
+        return -1;
+    } else if (num_pixels > width - 1) {
+        *problem = "excess pixels at end of row";
+        return -1;
+    }
+    return 1 + comp_size;
 }
 
-/* Top-level routine for reading a Badly Coded image file into an
-   internal format. All this function knows how to do is to match the
-   magic number and dispatch to an appropriate format-specific parse
-   function. Returns an image_info pointer on success, or a null
-   pointer on failure. */
-struct image_info *parse_image(const char *fname) {
-    FILE *fh = fopen(fname, "rb");
-    size_t num_read;
-    unsigned char magic[8];
-    struct image_info *info;
+/* Merge "num" samples from each of three planes into interleaved RGB
+   pixels, one at a time. */
+void merge_planes_scalar(unsigned char *pixels, unsigned char *r,
+                         unsigned char *g, unsigned char *b, long num) {
+    long i;
+    for (i = 0; i < num; i++) {
+        pixels[3*i + 0] = r[i];
+        pixels[3*i + 1] = g[i];
+        pixels[3*i + 2] = b[i];
+    }
+}
 
-    if (!fh) {
-        fprintf(stderr, "Failed to open %s: %s\n", fname, strerror(errno));
-        return 0;
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+/* SSSE3 version of merge_planes_scalar: 16 samples from each plane
+   are shuffled into place to make three 16-byte blocks of pixels.
+   The target attribute allows the instructions in just this function,
+   which is only called if the processor supports them. */
+__attribute__((target("ssse3")))
+void merge_planes_ssse3(unsigned char *pixels, unsigned char *r,
+                        unsigned char *g, unsigned char *b, long num) {
+    /* mask[k][c] picks the samples of channel c for output block k,
+       and zeros (index 0x80) for the other bytes. */
+    unsigned char masks[3][3][16];
+    __m128i mask[3][3];
+    long i;
+    int j, k, c;
+    for (k = 0; k < 3; k++) {
+        for (j = 0; j < 16; j++) {
+            int out = 16*k + j;
+            for (c = 0; c < 3; c++)
+                masks[k][c][j] = out % 3 == c ? out / 3 : 0x80;
+        }
+        for (c = 0; c < 3; c++)
+            mask[k][c] = _mm_loadu_si128((__m128i *)masks[k][c]);
     }
-    
-    num_read = fread(magic, 8, 1, fh);
-    if (num_read != 1) {
-        fprintf(stderr, "Failed to read magic number from %s\n", fname);
-        fclose(fh);
-        return 0;
+    for (i = 0; i + 16 <= num; i += 16) {
+        __m128i rv = _mm_loadu_si128((__m128i *)(r + i));
+        __m128i gv = _mm_loadu_si128((__m128i *)(g + i));
+        __m128i bv = _mm_loadu_si128((__m128i *)(b + i));
+        for (k = 0; k < 3; k++) {
+            __m128i out = _mm_or_si128(
+                _mm_or_si128(_mm_shuffle_epi8(rv, mask[k][0]),
+                             _mm_shuffle_epi8(gv, mask[k][1])),
+                _mm_shuffle_epi8(bv, mask[k][2]));
+            _mm_storeu_si128((__m128i *)(pixels + 3*i + 16*k), out);
+        }
     }
+    merge_planes_scalar(pixels + 3*i, r + i, g + i, b + i, num - i);
+}
+#endif
 
-    format_problem = 0;
-
-    if (memcmp(magic, bcraw_magic, 8) == 0) {
-        info = parse_bcraw(fh);
-    } else if (memcmp(magic, bcprog_magic, 8) == 0) {
-        info = parse_bcprog(fh);
-    } else if (memcmp(magic, bcflat_magic, 8) == 0) {
-        info = parse_bcflat(fh);
-    } else {
-        fprintf(stderr, "%s: unrecognized format\n", fname);
-        fclose(fh);
-        return 0;
+/* Merge three planes into interleaved pixels, using SSSE3 if the
+   processor has it. */
+void merge_planes(unsigned char *pixels, unsigned char *r,
+                  unsigned char *g, unsigned char *b, long num) {
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+    if (__builtin_cpu_supports("ssse3")) {
+        merge_planes_ssse3(pixels, r, g, b, num);
+        return;
     }
+#endif
+    merge_planes_scalar(pixels, r, g, b, num);
+}
 
-    fclose(fh);
+/* Decoding one row is a chain of dependent steps, since where each
+   codeword starts depends on the length of the one before. A single
+   chain leaves most of a modern processor idle, so when the row
+   starts are known, the three channels of a row of pixels are
+   decoded together: each pass of the main loop below takes a few
+   codewords from each of the three rows, and the processor can work
+   on all three chains at once.
 
-    if (!info) {
-        /* All different sorts of file errors lead to this message. */
-        if (format_problem)
-            fprintf(stderr, "%s: invalid format, %s\n", fname, format_problem);
-        else
-            fprintf(stderr, "%s: invalid format\n", fname);
+   The decoding is also split into two stages. The first only parses
+   codewords, producing a row of differences, so that adding up the
+   samples doesn't lengthen the chains. All the differences of a
+   codeword are the same, so they are stored 8 at once. The second
+   stage turns each row of differences into samples with a running
+   sum, several at a time using SIMD instructions, and then the three
+   rows are merged into the image. */
+
+/* A version of decode_flat that produces the differences between
+   samples rather than the samples themselves, one per byte. Each
+   codeword stores EXPANSION bytes, so there must be room for that
+   many after the last difference. The interface is otherwise the
+   same as decode_flat's, except that state->last isn't used. */
+void decode_flat_diffs(unsigned char *comp_p, int *comp_size_inout,
+                       unsigned char *diffs, int *pixels_inout,
+                       struct flat_decode_state *state) {
+    uint64_t reg = state->reg;
+    int reg_size = state->reg_size;
+    unsigned char *p = comp_p, *q = diffs;
+    unsigned char *comp_end = comp_p + *comp_size_inout;
+    int max_pixels = *pixels_inout;
+    int num_pixels = 0;
+
+    while (num_pixels < max_pixels && comp_end - p >= 8) {
+        int k;
+        reg |= load_u64_bigendian(p) >> reg_size;
+        p += (63 - reg_size) >> 3;
+        reg_size |= 56;
+        for (k = 0; k < 4 && num_pixels < max_pixels; k++) {
+            struct flat_code code = flat_codes[reg >> (64 - FLAT_CODE_BITS)];
+            uint64_t repeated = (unsigned char)code.diff
+                * 0x0101010101010101ULL;
+            memcpy(q, &repeated, 8);
+            q += code.num;
+            num_pixels += code.num;
+            reg <<= code.codelen;
+            reg_size -= code.codelen;
+        }
+    }
+    while (num_pixels < max_pixels) {
+        struct flat_code code;
+        uint64_t repeated;
+        int padding_bits;
+        if (reg_size < FLAT_CODE_BITS && p < comp_end) {
+            reg |= load_u64_bigendian(p) >> reg_size;
+            p += (63 - reg_size) >> 3;
+            reg_size |= 56;
+        }
+        padding_bits = p > comp_end ? 8 * (p - comp_end) : 0;
+        code = flat_codes[reg >> (64 - FLAT_CODE_BITS)];
+        if (code.codelen > reg_size - padding_bits)
+            break;
+        repeated = (unsigned char)code.diff * 0x0101010101010101ULL;
+        memcpy(q, &repeated, 8);
+        q += code.num;
+        num_pixels += code.num;
+        reg <<= code.codelen;
+        reg_size -= code.codelen;
     }
+    p -= reg_size >> 3;
+    reg_size &= 7;
+    reg = reg_size ? reg & (~(uint64_t)0 << (64 - reg_size)) : 0;
+    assert(p <= comp_end);
+    assert(num_pixels <= max_pixels + EXPANSION);
 
-    return info;
+    *comp_size_inout = p - comp_p;
+    *pixels_inout = num_pixels;
+    state->reg = reg;
+    state->reg_size = reg_size;
 }
 
-/* Do all the cleanup associated with an image_info that is no longer
-   needed: call the destructor if present, and free both the pixel
-   data and the structure. */
+/* Replace each of the "num" bytes of "row" with the sum (mod 256) of
+   it and all the bytes before it, one at a time. */
+void prefix_sum_scalar(unsigned char *row, long num) {
+    unsigned char sum = 0;
+    long i;
+    for (i = 0; i < num; i++) {
+        sum += row[i];
+        row[i] = sum;
+    }
+}
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+/* SSE2 version of prefix_sum_scalar. Within each block of 16 bytes,
+   adding the block to itself shifted by 1, 2, 4 and 8 bytes leaves
+   every byte holding the sum of it and the ones before it in the
+   block; then the total of all the earlier blocks is added in. */
+__attribute__((target("sse2")))
+void prefix_sum_sse2(unsigned char *row, long num) {
+    __m128i carry = _mm_setzero_si128();
+    long i;
+    for (i = 0; i + 16 <= num; i += 16) {
+        __m128i x = _mm_loadu_si128((__m128i *)(row + i));
+        x = _mm_add_epi8(x, _mm_slli_si128(x, 1));
+        x = _mm_add_epi8(x, _mm_slli_si128(x, 2));
+        x = _mm_add_epi8(x, _mm_slli_si128(x, 4));
+        x = _mm_add_epi8(x, _mm_slli_si128(x, 8));
+        x = _mm_add_epi8(x, carry);
+        _mm_storeu_si128((__m128i *)(row + i), x);
+        /* Copy the last byte to all 16 for the next block */
+        carry = _mm_srli_si128(x, 15);
+        carry = _mm_unpacklo_epi8(carry, carry);
+        carry = _mm_unpacklo_epi16(carry, carry);
+        carry = _mm_shuffle_epi32(carry, 0);
+    }
+    if (i > 0 && i < num)
+        row[i] += row[i - 1];
+    prefix_sum_scalar(row + i, num - i);
+}
+
+/* AVX2 version of prefix_sum_scalar, in blocks of 32 bytes. The byte
+   shifts only work within each 16-byte half, so the total of the
+   first half is then added to the second. */
+__attribute__((target("avx2")))
+void prefix_sum_avx2(unsigned char *row, long num) {
+    const __m256i last_byte = _mm256_set1_epi8(15);
+    __m256i carry = _mm256_setzero_si256();
+    long i;
+    for (i = 0; i + 32 <= num; i += 32) {
+        __m256i x = _mm256_loadu_si256((__m256i *)(row + i));
+        __m256i half_total;
+        x = _mm256_add_epi8(x, _mm256_slli_si256(x, 1));
+        x = _mm256_add_epi8(x, _mm256_slli_si256(x, 2));
+        x = _mm256_add_epi8(x, _mm256_slli_si256(x, 4));
+        x = _mm256_add_epi8(x, _mm256_slli_si256(x, 8));
+        /* Last byte of the first half into every byte of the second
+           half, and zeros in the first */
+        half_total = _mm256_shuffle_epi8(x, last_byte);
+        half_total = _mm256_permute2x128_si256(half_total, half_total, 0x08);
+        x = _mm256_add_epi8(x, half_total);
+        x = _mm256_add_epi8(x, carry);
+        _mm256_storeu_si256((__m256i *)(row + i), x);
+        carry = _mm256_shuffle_epi8(x, last_byte);
+        carry = _mm256_permute2x128_si256(carry, carry, 0x11);
+    }
+    if (i > 0 && i < num)
+        row[i] += row[i - 1];
+    prefix_sum_scalar(row + i, num - i);
+}
+#endif
+
+/* Turn a row of differences into samples, using the widest SIMD
+   instructions the processor has. */
+void prefix_sum(unsigned char *row, long num) {
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+    if (__builtin_cpu_supports("avx2")) {
+        prefix_sum_avx2(row, num);
+        return;
+    } else if (__builtin_cpu_supports("sse2")) {
+        prefix_sum_sse2(row, num);
+        return;
+    }
+#endif
+    prefix_sum_scalar(row, num);
+}
+
+/* One of the rows being decoded by decode_flat_pixel_row. */
+struct flat_lane {
+    unsigned char *p, *end;     /* compressed data left */
+    unsigned char *q;           /* next difference */
+    long left;                  /* samples left in the row */
+    struct flat_decode_state state;
+};
+
+/* Decode row "y" of all three channels of an image, whose rows start
+   at "row_start" as in flat_row_job, into "row". "scratch" must have
+   room for 3 * (width + EXPANSION) samples. Returns 1 on success, or
+   0 after storing a description of the format problem in
+   *problem. */
+int decode_flat_pixel_row(unsigned char *data, long *row_start,
+                          long height, long y, unsigned char *row,
+                          long width, unsigned char *scratch,
+                          const char **problem) {
+    struct flat_lane lanes[3];
+    int c;
+    for (c = 0; c < 3; c++) {
+        struct flat_lane *lane = &lanes[c];
+        long r = c * height + y;
+        lane->p = data + row_start[r];
+        lane->end = data + row_start[r + 1];
+        lane->q = scratch + c * (width + EXPANSION);
+        if (lane->p >= lane->end) {
+            *problem = "failed to read first byte";
+            return 0;
+        }
+        /* The first sample is a difference from 0 */
+        *lane->q++ = *lane->p++;
+        lane->left = width - 1;
+        lane->state.reg = 0;
+        lane->state.reg_size = 0;
+    }
+    /* Main loop: each pass decodes four codewords from each row, with
+       the same refills as decode_flat. That is at most 4 * EXPANSION
+       samples per row, so while more than that many are left there is
+       no need to check for the end of the row after each codeword.
+       Each codeword stores EXPANSION differences at once, and any
+       beyond its real ones are overwritten by the next codeword. */
+    for (;;) {
+        for (c = 0; c < 3; c++) {
+            if (lanes[c].left <= 4 * EXPANSION
+                || lanes[c].end - lanes[c].p < 8)
+                break;
+        }
+        if (c < 3)
+            break;
+        for (c = 0; c < 3; c++) {
+            struct flat_lane *lane = &lanes[c];
+            uint64_t reg = lane->state.reg;
+            int reg_size = lane->state.reg_size;
+            unsigned char *q = lane->q;
+            int k;
+            reg |= load_u64_bigendian(lane->p) >> reg_size;
+            lane->p += (63 - reg_size) >> 3;
+            reg_size |= 56;
+            for (k = 0; k < 4; k++) {
+                struct flat_code code =
+                    flat_codes[reg >> (64 - FLAT_CODE_BITS)];
+                uint64_t repeated = (unsigned char)code.diff
+                    * 0x0101010101010101ULL;
+                memcpy(q, &repeated, 8);
+                q += code.num;
+                lane->left -= code.num;
+                reg <<= code.codelen;
+                reg_size -= code.codelen;
+            }
+            lane->state.reg = reg;
+            lane->state.reg_size = reg_size;
+            lane->q = q;
+        }
+    }
+    /* Finish each row on its own. */
+    for (c = 0; c < 3; c++) {
+        struct flat_lane *lane = &lanes[c];
+        int comp_size = lane->end - lane->p;
+        int num_pixels = lane->left;
+        /* This can put back bytes loaded by the main loop, so the
+           size can come out negative. */
+        decode_flat_diffs(lane->p, &comp_size, lane->q, &num_pixels,
+                          &lane->state);
+        if (num_pixels < lane->left) {
+            *problem = "too little data";
+            return 0;
+        } else if (num_pixels > lane->left) {
+            *problem = "excess pixels at end of row";
+            return 0;
+        } else if (lane->p + comp_size != lane->end) {
+            *problem = "row index does not match data";
+            return 0;
+        }
+    }
+    for (c = 0; c < 3; c++)
+        prefix_sum(scratch + c * (width + EXPANSION), width);
+    merge_planes(row, scratch, scratch + width + EXPANSION,
+                 scratch + 2 * (width + EXPANSION), width);
+    return 1;
+}
+
+/* Check row "y" of all three channels of an image, as
+   decode_flat_pixel_row would decode it, without keeping the samples.
+   Returns 1 on success, or 0 after storing a description of the
+   format problem in *problem. */
+int check_flat_pixel_row(unsigned char *data, long *row_start,
+                         long height, long y, long width,
+                         const char **problem) {
+    int c;
+    for (c = 0; c < 3; c++) {
+        long r = c * height + y;
+        long size = row_start[r + 1] - row_start[r];
+        long len = decode_flat_row(data + row_start[r], size, 0, 1, width,
+                                   problem);
+        if (len < 0)
+            return 0;
+        if (len != size) {
+            *problem = "row index does not match data";
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/* Work shared between the threads decoding one image. Row "r" of
+   channel "c" starts at data + row_start[c * height + r], and the
+   entry after the last row marks the end of the data. If the image
+   has no pixels, the rows are only checked. */
+struct flat_row_job {
+    struct image_info *info;
+    unsigned char *data;
+    long *row_start;
+    pthread_mutex_t lock;   /* protects the fields below */
+    long next_y;            /* first row not yet handed out */
+    const char *problem;    /* first format problem found, if any */
+};
+
+/* Thread body: repeatedly take the next FLAT_ROWS_PER_TASK rows of the
+   image and decode all three channels of them. */
+void *flat_decode_worker(void *arg) {
+    struct flat_row_job *job = arg;
+    struct image_info *info = job->info;
+    unsigned char *scratch = xmalloc(3 * (info->width + EXPANSION));
+    long allocs_before = num_allocs;
+    for (;;) {
+        long y, y_start, y_end;
+        const char *problem = 0;
+        pthread_mutex_lock(&job->lock);
+        y_start = job->next_y;
+        job->next_y += FLAT_ROWS_PER_TASK;
+        pthread_mutex_unlock(&job->lock);
+        if (y_start >= info->height)
+            break;
+        y_end = y_start + FLAT_ROWS_PER_TASK;
+        if (y_end > info->height)
+            y_end = info->height;
+        for (y = y_start; y < y_end && !problem; y++) {
+            if (!info->pixels) {
+                check_flat_pixel_row(job->data, job->row_start,
+                                     info->height, y, info->width,
+                                     &problem);
+                continue;
+            }
+            decode_flat_pixel_row(job->data, job->row_start, info->height,
+                                  y, info->pixels + 3 * y * info->width,
+                                  info->width, scratch, &problem);
+        }
+        if (problem) {
+            pthread_mutex_lock(&job->lock);
+            if (!job->problem)
+                job->problem = problem;
+            pthread_mutex_unlock(&job->lock);
+            break;
+        }
+    }
+    check_no_allocs(allocs_before, "flat_decode_worker");
+    free(scratch);
+    return 0;
+}
+
+/* Decode the rows of an image whose row starts are already known,
+   using "num_threads" threads (including the calling one). Returns 1
+   on success, or 0 after setting format_problem. */
+int decode_flat_rows_parallel(struct image_info *info, unsigned char *data,
+                              long *row_start, int num_threads) {
+    struct flat_row_job job;
+    pthread_t *threads = xmalloc(num_threads * sizeof(pthread_t));
+    int i, num_started = 0;
+    job.info = info;
+    job.data = data;
+    job.row_start = row_start;
+    job.next_y = 0;
+    job.problem = 0;
+    pthread_mutex_init(&job.lock, 0);
+    for (i = 1; i < num_threads; i++) {
+        if (pthread_create(&threads[num_started], 0, flat_decode_worker,
+                           &job) != 0)
+            break;  /* the threads we already have can do the work */
+        num_started++;
+    }
+    flat_decode_worker(&job);
+    for (i = 0; i < num_started; i++)
+        pthread_join(threads[i], 0);
+    pthread_mutex_destroy(&job.lock);
+    free(threads);
+    if (job.problem) {
+        format_problem = job.problem;
+        return 0;
+    }
+    return 1;
+}
+
+/* Length-only pass over all the compressed data of an image, "size"
+   bytes at "data", to find where each row starts. Problems are found
+   in the same order as the sequential decoder finds them. Returns a
+   newly allocated array in the same format as flat_row_index, or a
+   null pointer after setting format_problem. */
+long *scan_flat_rows(unsigned char *data, long size, long width, long height) {
+    long pos = 0, r, num_rows = 3 * height;
+    long *row_start = xmalloc((num_rows + 1) * sizeof(long));
+    for (r = 0; r < num_rows; r++) {
+        const char *problem = 0;
+        long len = decode_flat_row(data + pos, size - pos, 0, 1, width,
+                                   &problem);
+        if (len < 0) {
+            format_problem = problem;
+            free(row_start);
+            return 0;
+        }
+        row_start[r] = pos;
+        pos += len;
+    }
+    row_start[num_rows] = pos;
+    return row_start;
+}
+
+/* Finding the row starts with scan_flat_rows is quick, but it is
+   still serial, and it limits how much faster the parallel decoder
+   can be with many threads. Instead, the data can be split into one
+   chunk per thread, with each thread guessing where the first row in
+   its chunk starts and scanning rows from there. The guesses don't
+   have to be right. The codewords are a prefix code, so a scan from a
+   wrong position soon falls into step with the real codewords, and
+   because every row has the same width, once one row a scan finds
+   starts where a real row does, all the rows after it are real too.
+   So the guesses are checked afterwards by following the real row
+   starts from the beginning of the data: as soon as a real row start
+   is one the scan of a chunk also found, the rest of that chunk's
+   starts are used as they are, and only the rows before that point
+   need to be scanned again.
+
+   The guesses are still worth making carefully, since every row
+   before a chunk falls into step is scanned twice. Two things help.
+   The encoders pad the end of each row with zero bits, so a guessed
+   row that ends with any other padding is taken to be wrong, even
+   though a decoder has to accept it. And rather than scanning a whole
+   row to try each possible start, a thread parses the codewords of a
+   few rows' worth of data once, ignoring where rows begin and end. A
+   scan from any start falls into step with that parse within a few
+   codewords, and from then on it sees the same codewords, so where
+   its row would end can be looked up by the number of samples. */
+
+/* Most codeword parses from different positions fall into step
+   within a few codewords; a guess that hasn't after this many is
+   given up on. */
+#define FLAT_SYNC_LIMIT 64
+
+/* Number of rows in a row that have to end properly before a
+   position is guessed to be a row start. Each wrong row has a fair
+   chance of ending with zero padding by accident, and there can be
+   thousands of positions to try before a real row start. */
+#define FLAT_GUESS_ROWS 4
+
+/* A parse of the codewords in a window of the data, ignoring the
+   row structure. */
+struct flat_parse_window {
+    long end;           /* byte after the window */
+    long num;           /* number of codeword boundaries */
+    long *bit;          /* bit offset in the data of each boundary */
+    long *count;        /* samples before each boundary */
+};
+
+/* Parse the codewords in bytes "begin" to "end" of the data into
+   "win", which needs room for 8 * (end - begin) / 3 + 2 boundaries
+   since every codeword has at least 3 bits. */
+void parse_flat_window(unsigned char *data, long begin, long end,
+                       struct flat_parse_window *win) {
+    long bit = 8 * begin, count = 0;
+    win->end = end;
+    win->num = 0;
+    for (;;) {
+        uint64_t reg;
+        struct flat_code code;
+        win->bit[win->num] = bit;
+        win->count[win->num] = count;
+        win->num++;
+        if (bit >= 8 * end)
+            break;
+        reg = load_u64_bigendian(data + (bit >> 3)) << (bit & 7);
+        code = flat_codes[reg >> (64 - FLAT_CODE_BITS)];
+        bit += code.codelen;
+        count += code.num;
+    }
+}
+
+/* Work out where a row that started at byte "p" would end, the same
+   way guess_flat_row would, but using the parse in "win" for all but
+   the first few codewords. Returns the byte after the row, -1 if no
+   row can start at "p", or -2 if the window is too small to tell. */
+long flat_window_row_end(unsigned char *data, long size, long width,
+                         struct flat_parse_window *win, long p) {
+    long bit = 8 * (p + 1), count = 0, lo, hi;
+    int steps;
+    if (p >= size)
+        return -1;
+    if (width == 1)
+        return p + 1;
+    for (steps = 0;; steps++) {
+        uint64_t reg;
+        struct flat_code code;
+        /* Binary search for the bit among the window's boundaries */
+        lo = 0;
+        hi = win->num;
+        while (lo < hi) {
+            long mid = lo + (hi - lo) / 2;
+            if (win->bit[mid] < bit)
+                lo = mid + 1;
+            else
+                hi = mid;
+        }
+        if (lo < win->num && win->bit[lo] == bit)
+            break;
+        if (bit >= 8 * win->end || steps == FLAT_SYNC_LIMIT)
+            return -2;
+        reg = load_u64_bigendian(data + (bit >> 3)) << (bit & 7);
+        code = flat_codes[reg >> (64 - FLAT_CODE_BITS)];
+        bit += code.codelen;
+        count += code.num;
+        if (count >= width - 1) {
+            if (count > width - 1)
+                return -1;
+            lo = -1;
+            break;
+        }
+    }
+    if (lo >= 0) {
+        /* In step with the window: find the boundary after the rest
+           of the row's samples. */
+        long target = win->count[lo] + (width - 1 - count);
+        hi = win->num;
+        while (lo < hi) {
+            long mid = lo + (hi - lo) / 2;
+            if (win->count[mid] < target)
+                lo = mid + 1;
+            else
+                hi = mid;
+        }
+        if (lo == win->num)
+            return -2;
+        if (win->count[lo] != target)
+            return -1;
+        bit = win->bit[lo];
+    }
+    if ((bit + 7) >> 3 > size)
+        return -1;
+    if ((bit & 7) && (data[bit >> 3] & (0xff >> (bit & 7))))
+        return -1;
+    return (bit + 7) >> 3;
+}
+
+/* Like decode_flat_row without a row, but also rejecting rows with
+   nonzero padding, which are allowed but never written. Returns the
+   number of compressed bytes in the row, or -1. */
+long guess_flat_row(unsigned char *p, long avail, long width) {
+    struct flat_decode_state state;
+    int comp_size, num_pixels;
+    if (avail < 1)
+        return -1;
+    if (width == 1)
+        return 1;
+    comp_size = avail - 1 < flat_row_limit(width) ? avail - 1
+        : flat_row_limit(width);
+    num_pixels = width - 1;
+    state.reg = 0;
+    state.reg_size = 0;
+    scan_flat(p + 1, &comp_size, &num_pixels, &state);
+    if (num_pixels != width - 1 || state.reg != 0)
+        return -1;
+    return 1 + comp_size;
+}
+
+/* Row starts found by guessing and scanning one chunk of the data.
+   The scan records every row start from its guess up to and
+   including the first one at or after "end". */
+struct flat_guess_chunk {
+    unsigned char *data;
+    long size;          /* size of all the data */
+    long width;
+    long begin, end;    /* range of bytes in this chunk */
+    long *starts;       /* row starts found, in increasing order */
+    long num_starts, alloc_starts;
+};
+
+/* Find the first byte at or after "pos" where it looks like a row
+   could start, because FLAT_GUESS_ROWS rows starting there would all
+   end properly. A row starts within flat_row_limit bytes of any
+   position, so if nothing looks right by then, give up and guess the
+   position after that. */
+long find_flat_row_start(struct flat_guess_chunk *chunk,
+                         struct flat_parse_window *win, long pos) {
+    long limit = flat_row_limit(chunk->width);
+    long win_end = pos + (FLAT_GUESS_ROWS + 1) * limit < chunk->size
+        ? pos + (FLAT_GUESS_ROWS + 1) * limit : chunk->size;
+    long p;
+    if (pos >= chunk->size)
+        return pos;
+    parse_flat_window(chunk->data, pos, win_end, win);
+    for (p = pos; p < pos + limit && p < chunk->size; p++) {
+        long e = p;
+        int k;
+        for (k = 0; k < FLAT_GUESS_ROWS && e >= 0; k++)
+            e = flat_window_row_end(chunk->data, chunk->size, chunk->width,
+                                    win, e);
+        /* If the window ran out, the full scan will tell */
+        if (e != -1)
+            return p;
+    }
+    return p;
+}
+
+/* Thread body: guess and scan the row starts of one chunk. */
+void *flat_guess_worker(void *arg) {
+    struct flat_guess_chunk *chunk = arg;
+    struct flat_parse_window win;
+    long limit = flat_row_limit(chunk->width);
+    long pos = chunk->begin;
+    long win_size = 8 * (FLAT_GUESS_ROWS + 1) * limit / 3 + 2;
+    win.bit = xmalloc(win_size * sizeof(long));
+    win.count = xmalloc(win_size * sizeof(long));
+    chunk->num_starts = 0;
+    /* The first chunk starts with a row, so only guess for the
+       others. */
+    if (pos > 0)
+        pos = find_flat_row_start(chunk, &win, pos);
+    while (pos < chunk->size) {
+        long len;
+        if (chunk->num_starts == chunk->alloc_starts) {
+            chunk->alloc_starts = 2 * chunk->alloc_starts + 64;
+            chunk->starts = realloc(chunk->starts,
+                                    chunk->alloc_starts * sizeof(long));
+            if (!chunk->starts) {
+                fprintf(stderr, "Out of memory guessing row starts\n");
+                exit(1);
+            }
+        }
+        chunk->starts[chunk->num_starts++] = pos;
+        if (pos >= chunk->end)
+            break;
+        len = guess_flat_row(chunk->data + pos, chunk->size - pos,
+                             chunk->width);
+        if (len < 0) {
+            /* This can't have been a real row start, and so neither
+               can any of the earlier ones that led to it. Guess
+               again after it. */
+            chunk->num_starts = 0;
+            pos = find_flat_row_start(chunk, &win, pos + 1);
+        } else {
+            pos += len;
+        }
+    }
+    free(win.bit);
+    free(win.count);
+    return 0;
+}
+
+/* Find the row starts of all the compressed data, like
+   scan_flat_rows, but using "num_threads" threads to guess and scan
+   chunks of the data at the same time. */
+long *guess_flat_rows(unsigned char *data, long size, long width,
+                      long height, int num_threads) {
+    struct flat_guess_chunk *chunks =
+        xmalloc(num_threads * sizeof(struct flat_guess_chunk));
+    pthread_t *threads = xmalloc(num_threads * sizeof(pthread_t));
+    int *started = xmalloc(num_threads * sizeof(int));
+    long pos = 0, r = 0, num_rows = 3 * height;
+    long *row_start = xmalloc((num_rows + 1) * sizeof(long));
+    int k;
+
+    for (k = 0; k < num_threads; k++) {
+        chunks[k].data = data;
+        chunks[k].size = size;
+        chunks[k].width = width;
+        chunks[k].begin = size / num_threads * k;
+        chunks[k].end = k == num_threads - 1 ? size
+            : size / num_threads * (k + 1);
+        chunks[k].starts = 0;
+        chunks[k].num_starts = chunks[k].alloc_starts = 0;
+    }
+    for (k = 1; k < num_threads; k++) {
+        started[k] = pthread_create(&threads[k], 0, flat_guess_worker,
+                                    &chunks[k]) == 0;
+    }
+    /* The first chunk's guess is known to be right. */
+    flat_guess_worker(&chunks[0]);
+    for (k = 1; k < num_threads; k++) {
+        if (started[k])
+            pthread_join(threads[k], 0);
+        else
+            flat_guess_worker(&chunks[k]);
+    }
+
+    /* Follow the real row starts through the chunks. */
+    k = 0;
+    while (r < num_rows) {
+        struct flat_guess_chunk *chunk;
+        long lo, hi, len;
+        const char *problem = 0;
+        while (k < num_threads - 1 && pos >= chunks[k + 1].begin)
+            k++;
+        chunk = &chunks[k];
+        /* Binary search for pos among the chunk's guessed starts */
+        lo = 0;
+        hi = chunk->num_starts;
+        while (lo < hi) {
+            long mid = lo + (hi - lo) / 2;
+            if (chunk->starts[mid] < pos)
+                lo = mid + 1;
+            else
+                hi = mid;
+        }
+        if (lo < chunk->num_starts - 1 && chunk->starts[lo] == pos) {
+            /* In step: the rest of the chunk's rows are real */
+            while (r < num_rows && lo < chunk->num_starts - 1) {
+                row_start[r++] = pos;
+                pos = chunk->starts[++lo];
+            }
+            continue;
+        }
+        /* Not in step (yet), so scan this row again */
+        len = decode_flat_row(data + pos, size - pos, 0, 1, width, &problem);
+        if (len < 0) {
+            format_problem = problem;
+            free(row_start);
+            row_start = 0;
+            break;
+        }
+        row_start[r++] = pos;
+        pos += len;
+    }
+    if (row_start)
+        row_start[num_rows] = pos;
+
+    for (k = 0; k < num_threads; k++)
+        free(chunks[k].starts);
+    free(chunks);
+    free(threads);
+    free(started);
+    return row_start;
+}
+
+/* Parallel version of read_flat_data_sequential. Returns 1 on success,
+   0 on an error. */
+int read_flat_data_parallel(FILE *fh, struct image_info *info,
+                            int num_threads) {
+    long size;
+    long *row_start;
+    unsigned char *data;
+    int is_ok;
+
+    data = read_flat_all(fh, 1, &size);
+    if (!data)
+        return 0;
+
+    row_start = guess_flat_rows(data, size, info->width, info->height,
+                                num_threads);
+    if (!row_start) {
+        free(data);
+        return 0;
+    }
+
+    is_ok = decode_flat_rows_parallel(info, data, row_start, num_threads);
+    free(row_start);
+    free(data);
+    return is_ok;
+}
+
+/* Check that the row index from an RIDX tag is plausible for an
+   image: the first row starts at the beginning of the data, and every
+   row takes at least one byte and no more than any row of that width
+   could. Whether the offsets really match the data can only be found
+   out by decoding. Returns 1 if the index is OK, 0 otherwise. */
+int check_flat_row_index(long *row_index, struct image_info *info) {
+    long r, num_rows = 3 * info->height;
+    if (row_index[0] != 0) {
+        format_problem = "invalid row index";
+        return 0;
+    }
+    for (r = 0; r < num_rows; r++) {
+        long size = row_index[r + 1] - row_index[r];
+        if (size < 1 || size > flat_row_limit(info->width)) {
+            format_problem = "invalid row index";
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/* Decode a BCFLAT image using the row starts from its RIDX tag, so no
+   scan is needed before the rows are decoded in parallel. Returns 1
+   on success, 0 on an error. */
+int read_flat_data_indexed(FILE *fh, struct image_info *info,
+                           long *row_index, int num_threads) {
+    long size;
+    unsigned char *data;
+    int is_ok;
+
+    data = read_flat_all(fh, 1, &size);
+    if (!data)
+        return 0;
+    if (row_index[3 * info->height] > size) {
+        format_problem = "too little data";
+        free(data);
+        return 0;
+    }
+    is_ok = decode_flat_rows_parallel(info, data, row_index, num_threads);
+    free(data);
+    return is_ok;
+}
+
+/* Another way to decode in parallel is to decode the red, green,
+   and blue planes at the same time, each by its own thread. The
+   samples then go into three separate planes, where they can be
+   written one after another instead of 3 bytes apart, and a final
+   pass merges the planes into the interleaved image. */
+
+/* Whether to decode large BCFLAT images one plane per thread, rather
+   than in groups of rows. */
+int flat_planar = 0;
+
+/* Work for the thread decoding one plane of an image. Row "y" of the
+   plane starts at data + row_start[y], as in flat_row_job. */
+struct flat_plane_job {
+    unsigned char *data;
+    long *row_start;
+    unsigned char *plane;   /* width * height samples */
+    long width, height;
+    const char *problem;    /* format problem found, if any */
+};
+
+/* Thread body: decode all the rows of one plane. */
+void *flat_plane_worker(void *arg) {
+    struct flat_plane_job *job = arg;
+    long y, allocs_before = num_allocs;
+    job->problem = 0;
+    for (y = 0; y < job->height; y++) {
+        long size = job->row_start[y + 1] - job->row_start[y];
+        long len = decode_flat_row(job->data + job->row_start[y], size,
+                                   job->plane + y * job->width, 1,
+                                   job->width, &job->problem);
+        if (len < 0)
+            break;
+        if (len != size) {
+            job->problem = "row index does not match data";
+            break;
+        }
+    }
+    check_no_allocs(allocs_before, "flat_plane_worker");
+    return 0;
+}
+
+/* Decode a BCFLAT image one plane per thread. The starts of the
+   planes come from the row index if there is one, and otherwise from
+   guess_flat_rows. Returns 1 on success, 0 on an error. */
+int read_flat_data_planar(FILE *fh, struct image_info *info,
+                          long *row_index, int num_threads) {
+    struct flat_plane_job jobs[3];
+    pthread_t threads[3];
+    int started[3];
+    long size, num = info->width * info->height;
+    long *row_start = row_index;
+    unsigned char *data, *planes;
+    int c;
+
+    data = read_flat_all(fh, 1, &size);
+    if (!data)
+        return 0;
+    if (!row_start) {
+        row_start = guess_flat_rows(data, size, info->width, info->height,
+                                    num_threads);
+        if (!row_start) {
+            free(data);
+            return 0;
+        }
+    } else if (row_start[3 * info->height] > size) {
+        format_problem = "too little data";
+        free(data);
+        return 0;
+    }
+
+    planes = xmalloc(3 * num);
+    for (c = 0; c < 3; c++) {
+        jobs[c].data = data;
+        jobs[c].row_start = row_start + c * info->height;
+        jobs[c].plane = planes + c * num;
+        jobs[c].width = info->width;
+        jobs[c].height = info->height;
+    }
+    for (c = 1; c < 3; c++) {
+        started[c] = pthread_create(&threads[c], 0, flat_plane_worker,
+                                    &jobs[c]) == 0;
+    }
+    flat_plane_worker(&jobs[0]);
+    for (c = 1; c < 3; c++) {
+        if (started[c])
+            pthread_join(threads[c], 0);
+        else
+            flat_plane_worker(&jobs[c]);
+    }
+    if (row_start != row_index)
+        free(row_start);
+    free(data);
+
+    /* Report the problem the sequential decoder would have found
+       first. */
+    for (c = 0; c < 3; c++) {
+        if (jobs[c].problem) {
+            format_problem = jobs[c].problem;
+            free(planes);
+            return 0;
+        }
+    }
+    merge_planes(info->pixels, planes, planes + num, planes + 2 * num, num);
+    free(planes);
+    return 1;
+}
+
+/* Read and decompress the compressed samples of a BCFLAT image, in
+   parallel if it is large enough and more than one thread is
+   available. Returns 1 on success, 0 on an error. */
+int read_flat_data(FILE *fh, struct image_info *info) {
+    int num_threads = flat_thread_count();
+    init_flat_codes();
+    if (flat_row_index && !check_flat_row_index(flat_row_index, info))
+        return 0;
+    if (num_threads > 1
+        && 3 * info->width * info->height >= FLAT_PARALLEL_MIN) {
+        if (flat_planar)
+            return read_flat_data_planar(fh, info, flat_row_index,
+                                         num_threads);
+        if (flat_row_index)
+            return read_flat_data_indexed(fh, info, flat_row_index,
+                                          num_threads);
+        return read_flat_data_parallel(fh, info, num_threads);
+    }
+    /* With an index, even one thread can decode the channels of each
+       row together. */
+    if (flat_row_index)
+        return read_flat_data_indexed(fh, info, flat_row_index, 1);
+    return read_flat_data_sequential(fh, info);
+}
+
+/* Two of the reserved bytes of the BCFLAT flags select an optional
+   revision of the codec, which compresses better but is only handled
+   by read_flat_data_variant, one row at a time:
+
+   flags[4]  1 adds a codeword for long runs of zero differences:
+             1111001 followed by 8 bits L stands for 8 * (L + 1)
+             zeros, up to 2048. Otherwise 1111001 is reserved as
+             before.
+   flags[5]  what each difference is relative to: the sample to the
+             left (FLAT_PREDICT_LEFT, as in BCFLAT), the one above it
+             in the same channel (FLAT_PREDICT_UP), or the average of
+             those two, rounded up (FLAT_PREDICT_AVERAGE).
+
+   The first sample of each row is still stored as it is, and the
+   first row of each channel is always relative to the left, since
+   there is no row above it. Images with both bytes 0 are plain
+   BCFLAT. */
+#define FLAT_PREDICT_LEFT 0
+#define FLAT_PREDICT_UP 1
+#define FLAT_PREDICT_AVERAGE 2
+#define FLAT_LONG_RUN_CODE 0x79 /* 1111001 */
+#define FLAT_LONG_RUN_BITS 15
+
+/* Whether a BCFLAT header's flags select the codec variant. */
+int flat_variant(const unsigned char *flags) {
+    return flags[4] != 0 || flags[5] != 0;
+}
+
+/* Decode the differences for one row of one channel in the codec
+   variant from an input stage into "diffs", with room for "width" +
+   EXPANSION bytes, and the first sample in diffs[0]. This goes one
+   codeword at a time, with whole unused bytes put back into the
+   input stage before each refill, so that a refill never moves bytes
+   still in the shift register. Returns 1 on success, or 0 after
+   setting format_problem. */
+int read_flat_variant_row(struct flat_input *in, unsigned char *diffs,
+                          long width, int long_runs) {
+    uint64_t reg = 0;
+    int reg_size = 0, padding_bits = 0;
+    long x = 1;
+    if (!fill_flat_input(in))
+        return 0;
+    if (in->pos == in->end) {
+        format_problem = "failed to read first byte";
+        return 0;
+    }
+    diffs[0] = in->buf[in->pos++];
+    while (x < width) {
+        int codelen;
+        long num;
+        unsigned char diff;
+        if (reg_size < FLAT_LONG_RUN_BITS + 1) {
+            in->pos -= reg_size >> 3;
+            reg_size &= 7;
+            reg = reg_size ? reg & (~(uint64_t)0 << (64 - reg_size)) : 0;
+            if (!fill_flat_input(in))
+                return 0;
+            reg |= load_u64_bigendian(in->buf + in->pos) >> reg_size;
+            in->pos += (63 - reg_size) >> 3;
+            reg_size |= 56;
+            /* Bytes past the end of the data are only zero padding */
+            padding_bits = in->pos > in->end ? 8 * (in->pos - in->end) : 0;
+        }
+        if (long_runs && reg >> 57 == FLAT_LONG_RUN_CODE) {
+            codelen = FLAT_LONG_RUN_BITS;
+            num = 8 * (((reg >> (64 - FLAT_LONG_RUN_BITS)) & 0xff) + 1);
+            diff = 0;
+        } else {
+            struct flat_code code = flat_codes[reg >> (64 - FLAT_CODE_BITS)];
+            codelen = code.codelen;
+            num = code.num;
+            diff = code.diff;
+        }
+        if (codelen > reg_size - padding_bits) {
+            format_problem = "too little data";
+            return 0;
+        } else if (num > width - x) {
+            format_problem = "excess pixels at end of row";
+            return 0;
+        }
+        if (num <= EXPANSION) {
+            uint64_t fill = diff * 0x0101010101010101ULL;
+            memcpy(diffs + x, &fill, 8);
+        } else {
+            memset(diffs + x, 0, num);
+        }
+        x += num;
+        reg <<= codelen;
+        reg_size -= codelen;
+    }
+    in->pos -= reg_size >> 3;
+    return 1;
+}
+
+/* Add each sample of "up" to the same one of "row", for samples 1 to
+   "width" - 1, as FLAT_PREDICT_UP needs. */
+void predict_up_scalar(unsigned char *row, const unsigned char *up,
+                       long width) {
+    long x;
+    for (x = 1; x < width; x++)
+        row[x] += up[x];
+}
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+/* SSE2 version of predict_up_scalar, 16 samples at a time. */
+__attribute__((target("sse2")))
+void predict_up_sse2(unsigned char *row, const unsigned char *up,
+                     long width) {
+    long x;
+    for (x = 1; x + 16 <= width; x += 16) {
+        __m128i r = _mm_loadu_si128((__m128i *)(row + x));
+        __m128i u = _mm_loadu_si128((const __m128i *)(up + x));
+        _mm_storeu_si128((__m128i *)(row + x), _mm_add_epi8(r, u));
+    }
+    for (; x < width; x++)
+        row[x] += up[x];
+}
+#endif
+
+/* Turn a row of differences into samples in place, given how they
+   were predicted and the row above in the same channel, or a null
+   pointer for the first row. Each average depends on the sample just
+   decoded, so that predictor can only go one sample at a time; the
+   previous sample is kept in a variable rather than read back from
+   the row, which the compiler can't otherwise assume "up" doesn't
+   overlap. */
+void predict_flat_row(unsigned char *row, const unsigned char *up,
+                      long width, int predictor) {
+    long x;
+    if (!up || predictor == FLAT_PREDICT_LEFT) {
+        prefix_sum(row, width);
+    } else if (predictor == FLAT_PREDICT_UP) {
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+        if (__builtin_cpu_supports("sse2")) {
+            predict_up_sse2(row, up, width);
+            return;
+        }
+#endif
+        predict_up_scalar(row, up, width);
+    } else {
+        unsigned char prev = row[0];
+        for (x = 1; x < width; x++) {
+            prev = row[x] + ((prev + up[x] + 1) >> 1);
+            row[x] = prev;
+        }
+    }
+}
+
+/* Read the compressed samples of a BCFLAT image in the codec variant
+   selected by "flags", keeping rows "y0" up to y0 + num_rows of the
+   "height" rows in "pixels", or none of them if pixels is a null
+   pointer (to just check the data). Returns 1 on success, or 0 after
+   setting format_problem. */
+int read_flat_data_variant(FILE *fh, const unsigned char *flags,
+                           long width, long height, unsigned char *pixels,
+                           long y0, long num_rows) {
+    struct flat_input *in = get_flat_input();
+    unsigned char *rows = xmalloc(2 * (width + EXPANSION));
+    unsigned char *cur = rows, *up = rows + width + EXPANSION;
+    long x, y, allocs_before;
+    int c;
+    init_flat_codes();
+    start_flat_input(in, fh, FLAT_CRC_READ);
+    allocs_before = num_allocs;
+    for (c = 0; c < 3; c++) {
+        for (y = 0; y < height; y++) {
+            unsigned char *tmp;
+            if (!read_flat_variant_row(in, cur, width, flags[4])) {
+                free(rows);
+                return 0;
+            }
+            predict_flat_row(cur, y > 0 ? up : 0, width, flags[5]);
+            if (pixels && y >= y0 && y < y0 + num_rows) {
+                unsigned char *out = pixels + 3 * (y - y0) * width + c;
+                for (x = 0; x < width; x++)
+                    out[3 * x] = cur[x];
+            }
+            tmp = up;
+            up = cur;
+            cur = tmp;
+        }
+    }
+    check_no_allocs(allocs_before, "read_flat_data_variant");
+    free(rows);
+    return finish_flat_input(in);
+}
+
+long size_limit = 26754; /* floor(sqrt(2**31/3)) */
+
+/* Check the flags of a BCFLAT image. Returns 1 if they are valid, or
+   0 after setting format_problem. */
+int check_bcflat_flags(const unsigned char *flags) {
+    if (flags[0] != 0 || flags[1] != 0 || flags[2] != 0 || flags[3] != 0) {
+        format_problem = "reserved flags should be 0";
+        return 0;
+    }
+
+    if (flags[4] > 1) {
+        format_problem = "unsupported run codewords";
+        return 0;
+    }
+
+    if (flags[5] > FLAT_PREDICT_AVERAGE) {
+        format_problem = "unsupported predictor";
+        return 0;
+    }
+
+    if (flags[6] != 0x0d) {
+        format_problem = "unsupported dictionary size";
+        return 0; /* 0x0d = 13-bit dictionary */
+    }
+
+    if (flags[7] != 0x03) {
+        format_problem = "unsupported number of channels";
+        return 0; /* 0x03 = 3 channels */
+    }
+    return 1;
+}
+
+/* Check the size of a BCFLAT image. Returns 1 if it is valid, or 0
+   after setting format_problem. */
+int check_bcflat_size(long width, long height) {
+    /* Size must be positive */
+    if (height < 1 || width < 1) {
+        format_problem = "size must be positive";
+        return 0;
+    }
+
+    /* Sanity-check size */
+    if (height > size_limit || width > size_limit) {
+        format_problem = "size too large compared to stack";
+        return 0;
+    }
+    return 1;
+}
+
+/* Read and check the part of a BCFLAT header after the magic number:
+   the flags and the image size. Returns 1 if the header is valid, or
+   0 after setting format_problem. */
+int read_bcflat_header(FILE *fh, unsigned char *flags,
+                       long *width_out, long *height_out) {
+    size_t num_read;
+    long width, height;
+
+    num_read = fread(flags, 8, 1, fh);
+    if (num_read != 1) return 0;
+
+    if (!check_bcflat_flags(flags))
+        return 0;
+
+    width = read_u64_bigendian(fh);
+    if (width == -1) return 0;
+
+    height = read_u64_bigendian(fh);
+    if (height == -1) return 0;
+
+    if (!check_bcflat_size(width, height))
+        return 0;
+
+    *width_out = width;
+    *height_out = height;
+    return 1;
+}
+
+/* Read a BCFLAT image from a file into our internal format. Only the
+   magic number should have been read before calling this
+   routine. Returns a pointer to an image_info structure representing
+   the image, or a null pointer on failure such as invalid or
+   unsupported image contents. */
+struct image_info *parse_bcflat(FILE *fh) {
+    struct image_info *info, *info_footer;
+    int num_bytes, is_ok;
+    long width, height;
+    unsigned char flags[8], *pixels;
+
+    if (!read_bcflat_header(fh, flags, &width, &height))
+        return 0;
+
+    num_bytes = 3 * width * height;
+    pixels = xmalloc(num_bytes +
+                     TRAILER_ALIGNMENT + sizeof(struct image_info));
+    info_footer = trailer_location(pixels, num_bytes);
+    info_footer->width = width;
+    info_footer->height = height;
+    info_footer->pixels = pixels;
+    info_footer->create_time = -1;
+    info_footer->cleanup = 0;
+
+    is_ok = process_tagged_data(fh, info_footer, bcflat_magic);
+    if (!is_ok) {
+        free(pixels);
+        return 0;
+    }
+
+    if (flat_variant(flags))
+        is_ok = read_flat_data_variant(fh, flags, width, height, pixels,
+                                       0, height);
+    else
+        is_ok = read_flat_data(fh, info_footer);
+    if (!is_ok) {
+        free(pixels);
+        return 0;
+    }
+
+    /* Copy metadata from the footer into a new separate object */
+    info = xmalloc(sizeof(struct image_info));
+    info->width = info_footer->width;
+    info->height = info_footer->height;
+    info->create_time = info_footer->create_time;
+    info->pixels = info_footer->pixels;
+    info->cleanup = info_footer->cleanup;
+    return info;
+}
+
+/* Read a BCFLAT image from "fh", which may be a pipe that is still
+   being written to, with a push decoder: the compressed data is
+   decoded a piece at a time, as each read returns it, rather than
+   after waiting for all of it. Only the magic number should have been
+   read before calling this routine, and "fh" must be unbuffered, so
+   that none of the data is left in its buffer after the tags. The
+   codec variant isn't supported. The number of complete rows is
+   stored in *rows_out, even on failure. Returns a pointer to the
+   image, or a null pointer on failure. */
+struct image_info *parse_bcflat_push(FILE *fh, long *rows_out) {
+    struct image_info *info;
+    struct flat_push_decoder *d;
+    unsigned char flags[8], *chunk;
+    long width, height;
+    uint32_t crc = 0;
+    int is_ok = 1;
+
+    *rows_out = 0;
+    if (!read_bcflat_header(fh, flags, &width, &height))
+        return 0;
+    if (flat_variant(flags)) {
+        format_problem = "can't stream the codec variant";
+        return 0;
+    }
+    info = xmalloc(sizeof(struct image_info));
+    info->width = width;
+    info->height = height;
+    info->create_time = -1;
+    info->cleanup = 0;
+    info->pixels = 0;
+    if (!process_tagged_data(fh, info, bcflat_magic)) {
+        free(info);
+        return 0;
+    }
+    info->pixels = xmalloc(3 * width * height);
+
+    d = start_flat_push(info);
+    chunk = xmalloc(FLAT_INPUT_SIZE);
+    while (is_ok) {
+        ssize_t num = read(fileno(fh), chunk, FLAT_INPUT_SIZE);
+        if (num == 0)
+            break;
+        if (num < 0) {
+            if (errno == EINTR)
+                continue;
+            format_problem = "short read";
+            d->failed = 1;
+            is_ok = 0;
+            break;
+        }
+        if (data_crc != -1)
+            crc = crc32c(crc, chunk, num);
+        is_ok = feed_flat_push(d, chunk, num);
+    }
+    *rows_out = flat_push_rows(d);
+    if (!finish_flat_push(d))
+        is_ok = 0;
+    if (is_ok && data_crc != -1 && crc != data_crc) {
+        format_problem = "checksum mismatch";
+        is_ok = 0;
+    }
+    free(chunk);
+    if (!is_ok) {
+        free(info->pixels);
+        free(info);
+        return 0;
+    }
+    return info;
+}
+
+/* Decode one row of one channel from an input stage, with the
+   samples "stride" bytes apart, or if "row" is null, just skip over
+   it. Returns 1 on success, or 0 after setting format_problem. */
+int read_flat_row(struct flat_input *in, unsigned char *row, int stride,
+                  long width) {
+    struct flat_decode_state state;
+    long x = 1;
+    if (!fill_flat_input(in))
+        return 0;
+    if (in->pos == in->end) {
+        format_problem = "failed to read first byte";
+        return 0;
+    }
+    state.last = in->buf[in->pos++];
+    state.reg = 0;
+    state.reg_size = 0;
+    if (row)
+        row[0] = state.last;
+    while (x < width) {
+        int max_pixels = width - x;
+        int comp_size, num_pixels;
+        if (!fill_flat_input(in))
+            return 0;
+        comp_size = in->end - in->pos;
+        num_pixels = max_pixels;
+        if (row) {
+            decode_flat(in->buf + in->pos, &comp_size, row + stride * x,
+                        stride, &num_pixels, &state);
+        } else {
+            scan_flat(in->buf + in->pos, &comp_size, &num_pixels, &state);
+        }
+        if (num_pixels == 0) {
+            format_problem = "too little data";
+            return 0;
+        }
+        if (num_pixels > max_pixels) {
+            format_problem = "excess pixels at end of row";
+            return 0;
+        }
+        x += num_pixels;
+        in->pos += comp_size;
+    }
+    return 1;
+}
+
+/* Decode rows y0 up to (but not including) y1 of a BCFLAT image with
+   "height" rows into "part", reading the data straight through and
+   skipping the other rows with length-only scans. Nothing after the
+   last needed row is read. Returns 1 on success, 0 on an error. */
+int read_flat_rows_scanned(FILE *fh, struct image_info *part, long height,
+                           long y0, long y1) {
+    struct flat_input *in = get_flat_input();
+    int channel;
+    long y;
+    start_flat_input(in, fh, 0);
+    for (channel = 0; channel <= 2; channel++) {
+        long y_end = channel == 2 ? y1 : height;
+        for (y = 0; y < y_end; y++) {
+            unsigned char *row = 0;
+            if (y >= y0 && y < y1)
+                row = part->pixels + 3 * (y - y0) * part->width + channel;
+            if (!read_flat_row(in, row, 3, part->width))
+                return 0;
+        }
+    }
+    return 1;
+}
+
+/* Decode rows y0 up to y1 of a BCFLAT image with "height" rows into
+   "part", using its row index to read only the compressed data for
+   those rows. The file should be positioned at the start of the
+   data. Returns 1 on success, 0 on an error. */
+int read_flat_rows_indexed(FILE *fh, struct image_info *part, long height,
+                           long y0, long y1, long *row_index) {
+    long data_start = ftell(fh);
+    int channel;
+    if (data_start == -1) {
+        format_problem = "can't seek in file";
+        return 0;
+    }
+    for (channel = 0; channel <= 2; channel++) {
+        long begin = row_index[channel * height + y0];
+        long end = row_index[channel * height + y1];
+        unsigned char *data = xmalloc(end - begin + FLAT_PAD);
+        const char *problem = 0;
+        size_t num_read;
+        long y;
+        if (fseek(fh, data_start + begin, SEEK_SET) != 0) {
+            format_problem = "can't seek in file";
+            free(data);
+            return 0;
+        }
+        num_read = fread(data, 1, end - begin, fh);
+        if (num_read != end - begin) {
+            format_problem = "too little data";
+            free(data);
+            return 0;
+        }
+        memset(data + (end - begin), 0, FLAT_PAD);
+        for (y = y0; y < y1 && !problem; y++) {
+            long r = channel * height + y;
+            long size = row_index[r + 1] - row_index[r];
+            unsigned char *row =
+                part->pixels + 3 * (y - y0) * part->width + channel;
+            long len = decode_flat_row(data + (row_index[r] - begin), size,
+                                       row, 3, part->width, &problem);
+            if (len >= 0 && len != size)
+                problem = "row index does not match data";
+        }
+        free(data);
+        if (problem) {
+            format_problem = problem;
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/* Read just "num_rows" rows of a BCFLAT image, starting with row "y0",
+   into a new image of that height. This is much quicker than reading
+   the whole image when the image has a row index, since then only
+   the data for those rows is read. Otherwise the rows before them
+   are skipped by scanning, which is still quicker than decoding
+   them, and the data after them is only scanned as far as the last
+   channel's rows. Only the magic number should have been read before
+   calling this routine. Returns a pointer to the new image, or a null
+   pointer on failure. */
+struct image_info *parse_bcflat_rows(FILE *fh, long y0, long num_rows) {
+    struct image_info whole, *part;
+    unsigned char flags[8];
+    int is_ok;
+
+    if (!read_bcflat_header(fh, flags, &whole.width, &whole.height))
+        return 0;
+    whole.pixels = 0;
+    whole.create_time = -1;
+    whole.cleanup = 0;
+    if (!process_tagged_data(fh, &whole, bcflat_magic))
+        return 0;
+    if (y0 < 0 || num_rows < 1 || num_rows > whole.height - y0) {
+        format_problem = "rows outside the image";
+        return 0;
+    }
+
+    part = xmalloc(sizeof(struct image_info));
+    part->width = whole.width;
+    part->height = num_rows;
+    part->create_time = whole.create_time;
+    part->cleanup = 0;
+    part->pixels = xmalloc(3 * part->width * part->height);
+    init_flat_codes();
+    if (flat_variant(flags)) {
+        is_ok = read_flat_data_variant(fh, flags, whole.width, whole.height,
+                                       part->pixels, y0, num_rows);
+    } else if (data_crc != -1 && num_rows == whole.height) {
+        /* All of the rows are wanted, so the checksum can be checked
+           too */
+        is_ok = read_flat_data(fh, part);
+    } else if (flat_row_index) {
+        is_ok = check_flat_row_index(flat_row_index, &whole)
+            && read_flat_rows_indexed(fh, part, whole.height, y0,
+                                      y0 + num_rows, flat_row_index);
+    } else {
+        is_ok = read_flat_rows_scanned(fh, part, whole.height, y0,
+                                       y0 + num_rows);
+    }
+    if (!is_ok) {
+        free(part->pixels);
+        free(part);
+        return 0;
+    }
+    return part;
+}
+
+/* Because the channels are stored one after another, a BCFLAT image
+   usually can't be converted one row at a time: all of the red and
+   green data comes before the blue data for the first row. But once
+   it is known where each channel starts, the file can be read from
+   three places at once, with a separate file handle and input stage
+   for each channel, producing each row of pixels as soon as its
+   three channel rows have been decoded. Then only a few rows' worth
+   of memory is needed, however tall the image. */
+struct flat_row_stream {
+    long width, height;
+    long create_time;
+    long y;                     /* next row to be decoded */
+    FILE *fh[3];                /* positioned in each channel's data */
+    long channel_start[3];      /* file offset of each channel */
+    long channel_end[3];        /* file offset after each channel, or
+                                   -1 if not known */
+    long data_crc;              /* DCRC tag, or -1 if none */
+    struct flat_input in[3];
+    unsigned char *row;         /* the last row decoded, interleaved */
+};
+
+/* Free a row stream and close its files. */
+void close_flat_rows(struct flat_row_stream *stream) {
+    int c;
+    for (c = 0; c < 3; c++) {
+        if (stream->fh[c])
+            fclose(stream->fh[c]);
+        free(stream->in[c].buf);
+    }
+    free(stream->row);
+    free(stream);
+}
+
+/* Open a BCFLAT file for reading one row at a time. The starts of
+   the channels come from the row index if there is one, and
+   otherwise from a length-only scan of the red and green channels.
+   If there's a DCRC tag, each cursor keeps a checksum of its own
+   channel, the blue one running on to the end of the file, and
+   read_flat_stream_row joins them up after the last row. Returns the
+   new stream, or a null pointer after setting format_problem (or
+   printing a message, if the file can't be read). */
+struct flat_row_stream *open_flat_rows(const char *fname) {
+    struct flat_row_stream *stream;
+    struct image_info info;
+    unsigned char magic[8], flags[8];
+    long data_start, *channel_start;
+    int c, is_ok;
+
+    stream = xmalloc(sizeof(struct flat_row_stream));
+    channel_start = stream->channel_start;
+    stream->row = 0;
+    for (c = 0; c < 3; c++) {
+        stream->fh[c] = 0;
+        stream->in[c].buf = xmalloc(FLAT_INPUT_SIZE + FLAT_PAD);
+    }
+    stream->fh[0] = fopen(fname, "rb");
+    if (!stream->fh[0]) {
+        fprintf(stderr, "Failed to open %s: %s\n", fname, strerror(errno));
+        close_flat_rows(stream);
+        return 0;
+    }
+    format_problem = 0;
+    if (fread(magic, 8, 1, stream->fh[0]) != 1
+        || memcmp(magic, bcflat_magic, 8) != 0) {
+        format_problem = "not a BCFLAT image";
+        close_flat_rows(stream);
+        return 0;
+    }
+    is_ok = read_bcflat_header(stream->fh[0], flags, &info.width,
+                               &info.height);
+    if (is_ok && flat_variant(flags)) {
+        format_problem = "can't stream the codec variant";
+        is_ok = 0;
+    }
+    if (is_ok) {
+        info.pixels = 0;
+        info.create_time = -1;
+        info.cleanup = 0;
+        is_ok = process_tagged_data(stream->fh[0], &info, bcflat_magic);
+    }
+    if (is_ok && flat_row_index)
+        is_ok = check_flat_row_index(flat_row_index, &info);
+    data_start = ftell(stream->fh[0]);
+    if (is_ok && data_start == -1) {
+        format_problem = "can't seek in file";
+        is_ok = 0;
+    }
+    init_flat_codes();
+
+    /* Find where each channel starts */
+    channel_start[0] = data_start;
+    if (is_ok && flat_row_index) {
+        channel_start[1] = data_start + flat_row_index[info.height];
+        channel_start[2] = data_start + flat_row_index[2 * info.height];
+    } else if (is_ok) {
+        struct flat_input *in = &stream->in[0];
+        long y;
+        start_flat_input(in, stream->fh[0], 0);
+        for (c = 1; c <= 2 && is_ok; c++) {
+            for (y = 0; y < info.height && is_ok; y++)
+                is_ok = read_flat_row(in, 0, 3, info.width);
+            /* The file position is past what's still in the buffer */
+            channel_start[c] = ftell(stream->fh[0]) - (in->end - in->pos);
+        }
+    }
+    if (is_ok) {
+        stream->channel_end[0] = channel_start[1];
+        stream->channel_end[1] = channel_start[2];
+        stream->channel_end[2] = flat_row_index
+            ? data_start + flat_row_index[3 * info.height] : -1;
+    }
+    free(flat_row_index);
+    flat_row_index = 0;
+
+    /* Open the other two cursors, and go back for the first one */
+    for (c = 1; c <= 2 && is_ok; c++) {
+        stream->fh[c] = fopen(fname, "rb");
+        if (!stream->fh[c]) {
+            format_problem = "can't reopen file";
+            is_ok = 0;
+        }
+    }
+    for (c = 0; c <= 2 && is_ok; c++) {
+        if (fseek(stream->fh[c], channel_start[c], SEEK_SET) != 0) {
+            format_problem = "can't seek in file";
+            is_ok = 0;
+        }
+        start_flat_input(&stream->in[c], stream->fh[c],
+                         c < 2 ? FLAT_CRC_CONSUMED : FLAT_CRC_READ);
+    }
+    if (!is_ok) {
+        close_flat_rows(stream);
+        return 0;
+    }
+    stream->width = info.width;
+    stream->height = info.height;
+    stream->create_time = info.create_time;
+    stream->data_crc = data_crc;
+    stream->y = 0;
+    stream->row = xmalloc(3 * info.width);
+    return stream;
+}
+
+/* After the last row of a row stream, check the DCRC tag. The
+   checksums of the three channels are joined in file order, the blue
+   one taking in everything after the image as well. Returns 1 on
+   success, or 0 after setting format_problem. */
+int check_flat_stream_crc(struct flat_row_stream *stream) {
+    struct flat_input *in = stream->in;
+    long green_len, blue_len;
+    uint32_t crc;
+    if (stream->data_crc == -1)
+        return 1;
+    green_len = ftell(stream->fh[1]) - (in[1].end - in[1].pos)
+        - stream->channel_start[1];
+    crc = crc32c_combine(consumed_flat_crc(&in[0]),
+                         consumed_flat_crc(&in[1]), green_len);
+    if (!drain_flat_input(&in[2]))
+        return 0;
+    blue_len = ftell(stream->fh[2]) - stream->channel_start[2];
+    if (blue_len < 0) {
+        format_problem = "can't seek in file";
+        return 0;
+    }
+    crc = crc32c_combine(crc, in[2].crc, blue_len);
+    if (crc != stream->data_crc) {
+        format_problem = "checksum mismatch";
+        return 0;
+    }
+    return 1;
+}
+
+/* Decode the next row of a row stream into stream->row. Returns 1 on
+   success, or 0 after setting format_problem. */
+int read_flat_stream_row(struct flat_row_stream *stream) {
+    int c;
+    if (stream->y >= stream->height) {
+        format_problem = "no more rows";
+        return 0;
+    }
+    for (c = 0; c < 3; c++) {
+        struct flat_input *in = &stream->in[c];
+        if (!read_flat_row(in, stream->row + c, 3, stream->width))
+            return 0;
+        /* After the last row, each channel should have ended where
+           the next one starts */
+        if (stream->y == stream->height - 1 && stream->channel_end[c] != -1
+            && ftell(stream->fh[c]) - (in->end - in->pos)
+               != stream->channel_end[c]) {
+            format_problem = "row index does not match data";
+            return 0;
+        }
+    }
+    if (stream->y == stream->height - 1 && !check_flat_stream_crc(stream))
+        return 0;
+    stream->y++;
+    return 1;
+}
+
+/* In a BCFLAT image, the only way to find where a row starts is to
+   decode (or at least scan) everything before it, unless the file
+   happens to have a row index. BCFLAT2 is a variant that is split
+   into horizontal stripes that can be found without decoding:
+
+   magic           bcflat2_magic
+   flags           the same as for BCFLAT
+   width, height   big-endian 64-bit, as for BCFLAT
+   stripe rows     big-endian 64-bit number of rows per stripe (the
+                   last stripe may have fewer)
+   tags            as for BCFLAT, up to and including DATA
+   stripes         for each stripe, its length in bytes as a
+                   big-endian 64-bit number, then all of its rows of
+                   channel 0, then channel 1, then channel 2, each
+                   encoded as in BCFLAT
+
+   Skipping a stripe is then just a seek, and the stripes of an image
+   can be decoded by separate threads. Stripes are handed out to
+   threads the same way as groups of rows of an indexed BCFLAT
+   image. */
+
+/* Stripe height used when writing BCFLAT2 images. */
+#define FLAT2_STRIPE_ROWS 32
+
+/* Work shared between the threads decoding the stripes of a BCFLAT2
+   image. The compressed data of the stripes that are needed is in
+   "data", with stripe first_stripe + i starting at stripe_start[i],
+   and the entry after the last one marking the end. Only rows from
+   "y0" on are kept, in "part". */
+struct flat2_stripe_job {
+    struct image_info *part;
+    long y0, height, stripe_rows, first_stripe;
+    unsigned char *data;
+    long *stripe_start;
+    pthread_mutex_t lock;   /* protects the fields below */
+    long next;              /* first stripe not yet handed out */
+    long num_stripes;
+    const char *problem;    /* first format problem found, if any */
+};
+
+/* Decode the rows of stripe "i" of a job that fall in its range, and
+   scan over the others. Returns 1 on success, or 0 after storing a
+   description of the format problem in *problem. */
+int decode_flat2_stripe(struct flat2_stripe_job *job, long i,
+                        const char **problem) {
+    struct image_info *part = job->part;
+    long width = part->width;
+    long y_start = (job->first_stripe + i) * job->stripe_rows;
+    long y_end = y_start + job->stripe_rows;
+    unsigned char *p = job->data + job->stripe_start[i];
+    unsigned char *end = job->data + job->stripe_start[i + 1];
+    long y;
+    int c;
+    if (y_end > job->height)
+        y_end = job->height;
+    for (c = 0; c < 3; c++) {
+        for (y = y_start; y < y_end; y++) {
+            unsigned char *row = 0;
+            long len;
+            if (y >= job->y0 && y < job->y0 + part->height)
+                row = part->pixels + 3 * (y - job->y0) * width + c;
+            len = decode_flat_row(p, end - p, row, 3, width, problem);
+            if (len < 0)
+                return 0;
+            p += len;
+        }
+    }
+    if (p != end) {
+        *problem = "stripe length does not match data";
+        return 0;
+    }
+    return 1;
+}
+
+/* Thread body: repeatedly take the next stripe and decode it. */
+void *flat2_decode_worker(void *arg) {
+    struct flat2_stripe_job *job = arg;
+    long allocs_before = num_allocs;
+    for (;;) {
+        const char *problem = 0;
+        long i;
+        pthread_mutex_lock(&job->lock);
+        i = job->next++;
+        pthread_mutex_unlock(&job->lock);
+        if (i >= job->num_stripes)
+            break;
+        if (!decode_flat2_stripe(job, i, &problem)) {
+            pthread_mutex_lock(&job->lock);
+            if (!job->problem)
+                job->problem = problem;
+            job->next = job->num_stripes;
+            pthread_mutex_unlock(&job->lock);
+            break;
+        }
+    }
+    check_no_allocs(allocs_before, "flat2_decode_worker");
+    return 0;
+}
+
+/* Read just "num_rows" rows of a BCFLAT2 image, starting with row
+   "y0", into a new image of that height; if num_rows is -1, all the
+   rows from y0 on are read. Stripes before and after the rows are
+   skipped without being read. Only the magic number should have been
+   read before calling this routine. Returns a pointer to the new
+   image, or a null pointer on failure. */
+struct image_info *parse_bcflat2_rows(FILE *fh, long y0, long num_rows) {
+    struct flat2_stripe_job job;
+    struct image_info whole, *part;
+    unsigned char flags[8];
+    long i, size, last_stripe, data_size = 0, alloc_size = 0;
+    int num_threads = flat_thread_count(), num_started = 0, check_crc;
+    pthread_t *threads;
+    uint32_t crc = 0;
+
+    if (!read_bcflat_header(fh, flags, &whole.width, &whole.height))
+        return 0;
+    if (flat_variant(flags)) {
+        format_problem = "BCFLAT2 doesn't use the codec variant";
+        return 0;
+    }
+    job.stripe_rows = read_u64_bigendian(fh);
+    if (job.stripe_rows == -1)
+        return 0;
+    if (job.stripe_rows < 1) {
+        format_problem = "stripe height must be positive";
+        return 0;
+    }
+    whole.pixels = 0;
+    whole.create_time = -1;
+    whole.cleanup = 0;
+    if (!process_tagged_data(fh, &whole, bcflat2_magic))
+        return 0;
+    if (num_rows == -1)
+        num_rows = whole.height - y0;
+    if (y0 < 0 || num_rows < 1 || num_rows > whole.height - y0) {
+        format_problem = "rows outside the image";
+        return 0;
+    }
+    if (job.stripe_rows > whole.height)
+        job.stripe_rows = whole.height;
+
+    /* Read the stripes holding the rows, seeking over the ones
+       before them. The checksum can only be checked when all of them
+       are read. */
+    check_crc = data_crc != -1 && num_rows == whole.height;
+    job.first_stripe = y0 / job.stripe_rows;
+    last_stripe = (y0 + num_rows - 1) / job.stripe_rows;
+    job.num_stripes = last_stripe - job.first_stripe + 1;
+    job.stripe_start = xmalloc((job.num_stripes + 1) * sizeof(long));
+    /* Room for just the padding, until there is some data */
+    job.data = xmalloc(FLAT_PAD);
+    for (i = 0; i <= last_stripe; i++) {
+        long limit = 3 * job.stripe_rows * flat_row_limit(whole.width);
+        size = read_u64_bigendian(fh);
+        if (size == -1 || size < 1 || size > limit) {
+            /* Every stripe has at least one row, which takes at least
+               one byte */
+            if (size != -1)
+                format_problem = size < 1 ? "stripe too small"
+                    : "stripe too large";
+            free(job.stripe_start);
+            free(job.data);
+            return 0;
+        }
+        if (i < job.first_stripe) {
+            if (fseek(fh, size, SEEK_CUR) != 0) {
+                format_problem = "short read of stripe";
+                free(job.stripe_start);
+                free(job.data);
+                return 0;
+            }
+            continue;
+        }
+        if (data_size + size > alloc_size) {
+            alloc_size = 2 * (data_size + size);
+            job.data = realloc(job.data, alloc_size + FLAT_PAD);
+            if (!job.data) {
+                fprintf(stderr, "Out of memory in allocation of %ld bytes\n",
+                        alloc_size + FLAT_PAD);
+                exit(1);
+            }
+        }
+        job.stripe_start[i - job.first_stripe] = data_size;
+        if (fread(job.data + data_size, 1, size, fh) != size) {
+            format_problem = "short read of stripe";
+            free(job.stripe_start);
+            free(job.data);
+            return 0;
+        }
+        if (check_crc) {
+            unsigned char size_bytes[8];
+            store_u64_bigendian(size_bytes, size);
+            crc = crc32c(crc, size_bytes, 8);
+            crc = crc32c(crc, job.data + data_size, size);
+        }
+        data_size += size;
+    }
+    if (check_crc && !finish_data_crc(fh, crc)) {
+        free(job.stripe_start);
+        free(job.data);
+        return 0;
+    }
+    job.stripe_start[job.num_stripes] = data_size;
+    memset(job.data + data_size, 0, FLAT_PAD);
+
+    part = xmalloc(sizeof(struct image_info));
+    part->width = whole.width;
+    part->height = num_rows;
+    part->create_time = whole.create_time;
+    part->cleanup = 0;
+    part->pixels = xmalloc(3 * part->width * part->height);
+    job.part = part;
+    job.y0 = y0;
+    job.height = whole.height;
+    job.next = 0;
+    job.problem = 0;
+    pthread_mutex_init(&job.lock, 0);
+    init_flat_codes();
+    if (job.num_stripes < 2 || 3 * part->width * num_rows < FLAT_PARALLEL_MIN)
+        num_threads = 1;
+    threads = xmalloc(num_threads * sizeof(pthread_t));
+    for (i = 1; i < num_threads; i++) {
+        if (pthread_create(&threads[num_started], 0, flat2_decode_worker,
+                           &job) != 0)
+            break;  /* the threads we already have can do the work */
+        num_started++;
+    }
+    flat2_decode_worker(&job);
+    for (i = 0; i < num_started; i++)
+        pthread_join(threads[i], 0);
+    pthread_mutex_destroy(&job.lock);
+    free(threads);
+    free(job.stripe_start);
+    free(job.data);
+    if (job.problem) {
+        format_problem = job.problem;
+        free(part->pixels);
+        free(part);
+        return 0;
+    }
+    return part;
+}
+
+/* Read a whole BCFLAT2 image into our internal format. Only the magic
+   number should have been read before calling this routine. Returns a
+   pointer to the image, or a null pointer on failure. */
+struct image_info *parse_bcflat2(FILE *fh) {
+    return parse_bcflat2_rows(fh, 0, -1);
+}
+
+/* Check the compressed samples of a large BCFLAT image with
+   "num_threads" threads, the same way read_flat_data_indexed or
+   read_flat_data_parallel would find its rows, but only scanning
+   them. All of the data is read into memory, but none is needed for
+   the pixels. The checksum is only checked once the rows are, so
+   that problems are described as validate_flat_data describes them.
+   Returns 1 if the data is OK, 0 otherwise. */
+int validate_flat_data_parallel(FILE *fh, struct image_info *info,
+                                int num_threads) {
+    long size, *row_start;
+    unsigned char *data;
+    int is_ok = 1;
+
+    data = read_flat_all(fh, 0, &size);
+    if (!data)
+        return 0;
+    if (flat_row_index) {
+        /* Each row is scanned from its indexed start, and has to end
+           where the next one starts. */
+        if (flat_row_index[3 * info->height] > size) {
+            format_problem = "too little data";
+            is_ok = 0;
+        }
+        if (is_ok)
+            is_ok = decode_flat_rows_parallel(info, data, flat_row_index,
+                                              num_threads);
+    } else {
+        /* Finding the row starts scans every row already */
+        row_start = guess_flat_rows(data, size, info->width, info->height,
+                                    num_threads);
+        is_ok = row_start != 0;
+        free(row_start);
+    }
+    if (is_ok && data_crc != -1 && crc32c(0, data, size) != data_crc) {
+        format_problem = "checksum mismatch";
+        is_ok = 0;
+    }
+    free(data);
+    return is_ok;
+}
+
+/* Check the compressed samples of a BCFLAT image without decoding
+   them, by walking over the codewords with scan_flat. This finds the
+   same problems, with the same descriptions, as
+   read_flat_data_sequential, and also checks the row index if there
+   is one. No memory is needed for the pixels. One thread scans a few
+   hundred megabytes a second, so large images are checked in
+   parallel, like read_flat_data decodes them, if more than one thread
+   is available; gigabytes a second take several cores. Returns 1 if
+   the data is OK, 0 otherwise. */
+int validate_flat_data(FILE *fh, struct image_info *info) {
+    int channel, num_threads = flat_thread_count();
+    long y, r = 0, offset = 0;
+    struct flat_decode_state state;
+    struct flat_input *in = get_flat_input();
+    init_flat_codes();
+    if (flat_row_index && !check_flat_row_index(flat_row_index, info))
+        return 0;
+    if (num_threads > 1 && 3 * info->width * info->height >= FLAT_PARALLEL_MIN)
+        return validate_flat_data_parallel(fh, info, num_threads);
+    start_flat_input(in, fh, FLAT_CRC_READ);
+    for (channel = 0; channel <= 2; channel++) {
+        for (y = 0; y < info->height; y++) {
+            long x = 1;
+            if (!fill_flat_input(in))
+                return 0;
+            if (in->pos == in->end) {
+                format_problem = "failed to read first byte";
+                return 0;
+            }
+            if (flat_row_index && flat_row_index[r] != offset) {
+                format_problem = "row index does not match data";
+                return 0;
+            }
+            in->pos++;
+            offset++;
+            state.reg = 0;
+            state.reg_size = 0;
+            while (x < info->width) {
+                int max_pixels = info->width - x;
+                int comp_size, num_pixels;
+                if (!fill_flat_input(in))
+                    return 0;
+                comp_size = in->end - in->pos;
+                num_pixels = max_pixels;
+                scan_flat(in->buf + in->pos, &comp_size, &num_pixels, &state);
+                if (num_pixels == 0) {
+                    format_problem = "too little data";
+                    return 0;
+                }
+                if (num_pixels > max_pixels) {
+                    format_problem = "excess pixels at end of row";
+                    return 0;
+                }
+                x += num_pixels;
+                in->pos += comp_size;
+                offset += comp_size;
+            }
+            r++;
+        }
+    }
+    if (flat_row_index && flat_row_index[r] != offset) {
+        format_problem = "row index does not match data";
+        return 0;
+    }
+    return finish_flat_input(in);
+}
+
+/* Check a BCFLAT file the way parse_bcflat reads it, but without
+   decoding the samples. Only the magic number should have been read
+   before calling this routine. Returns 1 if the file is OK, 0
+   otherwise. */
+int validate_bcflat(FILE *fh) {
+    struct image_info info;
+    unsigned char flags[8];
+    const char *old_logging_fmt = logging_fmt;
+    int is_ok;
+
+    if (!read_bcflat_header(fh, flags, &info.width, &info.height))
+        return 0;
+    info.pixels = 0;
+    info.create_time = -1;
+    info.cleanup = 0;
+
+    /* Checking a file shouldn't change how later images are
+       logged. */
+    if (flat_variant(flags))
+        is_ok = process_tagged_data(fh, &info, bcflat_magic)
+            && read_flat_data_variant(fh, flags, info.width, info.height,
+                                      0, 0, 0);
+    else
+        is_ok = process_tagged_data(fh, &info, bcflat_magic)
+            && validate_flat_data(fh, &info);
+    logging_fmt = old_logging_fmt;
+    return is_ok;
+}
+
+/* Do all the cleanup associated with an image_info that is no longer
+   needed: call the destructor if present, and free both the pixel
+   data and the structure. */
 void free_image_info(struct image_info *info) {
     if (info->cleanup)
         (*info->cleanup)();
@@ -508,6 +3099,1757 @@ void free_image_info(struct image_info *info) {
     free(info);
 }
 
+/* A BCSEQ file holds a sequence of frames of the same size, such as
+   the output of a camera watching a mostly static scene. After the
+   magic number come the 8 flag bytes and the width and height as in
+   BCFLAT, then the number of frames and the time between frames in
+   microseconds, each a 64-bit big-endian number, then the usual tags
+   and DATA. Each frame is one byte giving its kind, the size of its
+   compressed data as a 64-bit big-endian number, and then the data,
+   which is that of a BCFLAT image in the codec variant selected by
+   the flags. A key frame (SEQ_KEY_FRAME) holds the samples of the
+   frame itself, and a delta frame (SEQ_DELTA_FRAME) holds the
+   difference, modulo 256, between each sample and the same sample in
+   the frame before. The first frame must be a key frame. Parts of a
+   frame that didn't change are runs of zero differences, which the
+   long run codewords store in 15 bits per 2048 samples, and which
+   decode to rows of zeros that needn't be added at all. Each row is
+   coded relative to the left, as the rows above don't help predict a
+   difference.
+
+   The flags' predictor byte must be FLAT_PREDICT_LEFT, and a DCRC tag
+   covers the data of all of the frames. */
+#define SEQ_KEY_FRAME 0
+#define SEQ_DELTA_FRAME 1
+#define SEQ_FRAME_HEADER 9
+
+/* State for reading the frames of a BCSEQ file one after another,
+   into a single image that is updated in place. The same input stage
+   is used for the whole file, so frames are just consecutive stretches
+   of its data. */
+struct seq_reader {
+    FILE *fh;
+    struct image_info *info;    /* the most recently read frame */
+    unsigned char flags[8];
+    long num_frames;
+    long period;                /* microseconds between frames */
+    long frame;                 /* number of frames read so far */
+    long data_start;            /* file offset of the first frame */
+    struct flat_input in;
+    unsigned char *row;         /* one decoded row, plus EXPANSION */
+};
+
+/* Read the header and tags of a BCSEQ file from "fh", which must stay
+   open while the sequence is read, after its magic number. No frames
+   are read yet; the image is allocated but not filled in until
+   read_seq_frame is first called. If "check_crc" is set, any DCRC tag
+   is checked once the last frame is read. Returns a pointer to the new
+   reader, or a null pointer after setting format_problem. */
+struct seq_reader *open_seq(FILE *fh, int check_crc) {
+    struct seq_reader *seq;
+    struct image_info *info_footer;
+    unsigned char flags[8], *pixels;
+    long width, height, num_frames, period, num_bytes;
+
+    if (!read_bcflat_header(fh, flags, &width, &height))
+        return 0;
+    if (flags[5] != FLAT_PREDICT_LEFT) {
+        format_problem = "sequences must use the left predictor";
+        return 0;
+    }
+    num_frames = read_u64_bigendian(fh);
+    if (num_frames == -1)
+        return 0;
+    period = read_u64_bigendian(fh);
+    if (period == -1)
+        return 0;
+    if (num_frames < 1) {
+        format_problem = "sequence has no frames";
+        return 0;
+    }
+    if (period < 1) {
+        format_problem = "frame period must be positive";
+        return 0;
+    }
+
+    num_bytes = 3 * width * height;
+    pixels = xmalloc(num_bytes +
+                     TRAILER_ALIGNMENT + sizeof(struct image_info));
+    info_footer = trailer_location(pixels, num_bytes);
+    info_footer->width = width;
+    info_footer->height = height;
+    info_footer->pixels = pixels;
+    info_footer->create_time = -1;
+    info_footer->cleanup = 0;
+    if (!process_tagged_data(fh, info_footer, bcseq_magic)) {
+        free(pixels);
+        return 0;
+    }
+
+    seq = xmalloc(sizeof(struct seq_reader));
+    seq->fh = fh;
+    seq->info = xmalloc(sizeof(struct image_info));
+    seq->info->width = width;
+    seq->info->height = height;
+    seq->info->create_time = info_footer->create_time;
+    seq->info->pixels = pixels;
+    seq->info->cleanup = info_footer->cleanup;
+    memcpy(seq->flags, flags, 8);
+    seq->num_frames = num_frames;
+    seq->period = period;
+    seq->frame = 0;
+    seq->data_start = ftell(fh);
+    seq->in.buf = xmalloc(FLAT_INPUT_SIZE + FLAT_PAD);
+    seq->row = xmalloc(width + EXPANSION);
+    init_flat_codes();
+    start_flat_input(&seq->in, fh, check_crc ? FLAT_CRC_READ : 0);
+    return seq;
+}
+
+/* Offset in the file of the next unconsumed byte of an input stage. */
+long flat_input_offset(struct flat_input *in) {
+    return ftell(in->fh) - (in->end - in->pos);
+}
+
+/* Whether all "num" bytes of a row are zero. */
+int zero_row(const unsigned char *row, long num) {
+    uint64_t bits = 0, word;
+    long x = 0;
+    for (; x + 8 <= num; x += 8) {
+        memcpy(&word, row + x, 8);
+        bits |= word;
+    }
+    for (; x < num; x++)
+        bits |= row[x];
+    return bits == 0;
+}
+
+/* Decode the next frame of a sequence into seq->info, which keeps the
+   previous frame until then. Rows of a delta frame with no
+   differences leave the image untouched. Returns 1 on success, or 0
+   after setting format_problem, including when there are no frames
+   left; after a failure the image may be partly updated. */
+int read_seq_frame(struct seq_reader *seq) {
+    struct flat_input *in = &seq->in;
+    long width = seq->info->width, height = seq->info->height;
+    long size, start, x, y;
+    int kind, c;
+
+    if (seq->frame == seq->num_frames) {
+        format_problem = "no more frames";
+        return 0;
+    }
+    if (!fill_flat_input(in))
+        return 0;
+    if (in->end - in->pos < SEQ_FRAME_HEADER) {
+        format_problem = "short read of frame header";
+        return 0;
+    }
+    kind = in->buf[in->pos];
+    size = load_u64_bigendian(in->buf + in->pos + 1);
+    in->pos += SEQ_FRAME_HEADER;
+    if (kind != SEQ_KEY_FRAME && kind != SEQ_DELTA_FRAME) {
+        format_problem = "unknown frame kind";
+        return 0;
+    }
+    if (kind != SEQ_KEY_FRAME && seq->frame == 0) {
+        format_problem = "first frame must be a key frame";
+        return 0;
+    }
+
+    start = flat_input_offset(in);
+    for (c = 0; c < 3; c++) {
+        for (y = 0; y < height; y++) {
+            unsigned char *row = seq->row;
+            unsigned char *out = seq->info->pixels + 3 * y * width + c;
+            if (!read_flat_variant_row(in, row, width, seq->flags[4]))
+                return 0;
+            if (kind == SEQ_KEY_FRAME) {
+                prefix_sum(row, width);
+                for (x = 0; x < width; x++)
+                    out[3 * x] = row[x];
+            } else if (!zero_row(row, width)) {
+                prefix_sum(row, width);
+                for (x = 0; x < width; x++)
+                    out[3 * x] += row[x];
+            }
+        }
+    }
+    if (flat_input_offset(in) - start != size) {
+        format_problem = "frame size does not match data";
+        return 0;
+    }
+    seq->frame++;
+    if (seq->frame == seq->num_frames)
+        return finish_flat_input(in);
+    return 1;
+}
+
+/* Go back to the first frame of a sequence, for reading it again.
+   The checksum isn't checked a second time. Returns 1 on success, or
+   0 after setting format_problem. */
+int rewind_seq(struct seq_reader *seq) {
+    if (fseek(seq->fh, seq->data_start, SEEK_SET) != 0) {
+        format_problem = "failed to seek to first frame";
+        return 0;
+    }
+    seq->frame = 0;
+    start_flat_input(&seq->in, seq->fh, 0);
+    return 1;
+}
+
+/* Free a sequence reader and its image, but leave its file open. */
+void close_seq(struct seq_reader *seq) {
+    if (seq->info)
+        free_image_info(seq->info);
+    free(seq->in.buf);
+    free(seq->row);
+    free(seq);
+}
+
+/* Read the first frame of a BCSEQ file as an image, for programs that
+   only show still images. Only the magic number should have been read
+   before calling this routine. Returns a pointer to the image, or a
+   null pointer on failure. */
+struct image_info *parse_bcseq(FILE *fh) {
+    struct seq_reader *seq = open_seq(fh, 0);
+    struct image_info *info;
+    if (!seq)
+        return 0;
+    if (!read_seq_frame(seq)) {
+        close_seq(seq);
+        return 0;
+    }
+    info = seq->info;
+    seq->info = 0;
+    close_seq(seq);
+    return info;
+}
+
+/* Check every frame of a BCSEQ file, and its checksum if it has one,
+   by decoding them all. Only the magic number should have been read
+   before calling this routine. Returns 1 if the file is OK, 0
+   otherwise. */
+int validate_bcseq(FILE *fh) {
+    const char *old_logging_fmt = logging_fmt;
+    struct seq_reader *seq = open_seq(fh, 1);
+    int is_ok = seq != 0;
+    logging_fmt = old_logging_fmt;
+    while (is_ok && seq->frame < seq->num_frames)
+        is_ok = read_seq_frame(seq);
+    if (seq)
+        close_seq(seq);
+    return is_ok;
+}
+
+/* Read a Badly Coded image from the start of "fh", which is left
+   open, into an internal format. All this function knows how to do is
+   to match the magic number and dispatch to an appropriate
+   format-specific parse function. Problems are reported using the
+   name "fname". Returns an image_info pointer on success, or a null
+   pointer on failure. */
+struct image_info *parse_image_file(FILE *fh, const char *fname) {
+    size_t num_read;
+    unsigned char magic[8];
+    struct image_info *info;
+
+    num_read = fread(magic, 8, 1, fh);
+    if (num_read != 1) {
+        fprintf(stderr, "Failed to read magic number from %s\n", fname);
+        return 0;
+    }
+
+    format_problem = 0;
+
+    if (memcmp(magic, bcraw_magic, 8) == 0) {
+        info = parse_bcraw(fh);
+    } else if (memcmp(magic, bcprog_magic, 8) == 0) {
+        info = parse_bcprog(fh);
+    } else if (memcmp(magic, bcflat_magic, 8) == 0) {
+        info = parse_bcflat(fh);
+    } else if (memcmp(magic, bcflat2_magic, 8) == 0) {
+        info = parse_bcflat2(fh);
+    } else if (memcmp(magic, bcseq_magic, 8) == 0) {
+        info = parse_bcseq(fh);
+    } else {
+        fprintf(stderr, "%s: unrecognized format\n", fname);
+        return 0;
+    }
+
+    /* A row index is only used while decoding the image it came
+       with. */
+    free(flat_row_index);
+    flat_row_index = 0;
+
+    if (!info) {
+        /* All different sorts of file errors lead to this message. */
+        if (format_problem)
+            fprintf(stderr, "%s: invalid format, %s\n", fname, format_problem);
+        else
+            fprintf(stderr, "%s: invalid format\n", fname);
+    }
+
+    return info;
+}
+
+/* Top-level routine for reading a Badly Coded image file into an
+   internal format, using parse_image_file. Returns an image_info
+   pointer on success, or a null pointer on failure. */
+struct image_info *parse_image(const char *fname) {
+    FILE *fh = fopen(fname, "rb");
+    struct image_info *info;
+
+    if (!fh) {
+        fprintf(stderr, "Failed to open %s: %s\n", fname, strerror(errno));
+        return 0;
+    }
+    info = parse_image_file(fh, fname);
+    fclose(fh);
+    return info;
+}
+
+/* Check whether an image file is well-formed, reporting any problem
+   the same way as parse_image. BCFLAT images are checked without
+   decoding them, every frame of a BCSEQ sequence is decoded, and other
+   formats are decoded and thrown away. Returns 1 if the file is OK, 0
+   otherwise. */
+int validate_image(const char *fname) {
+    FILE *fh;
+    size_t num_read;
+    unsigned char magic[8];
+    int is_ok;
+
+    fh = fopen(fname, "rb");
+    if (!fh) {
+        fprintf(stderr, "Failed to open %s: %s\n", fname, strerror(errno));
+        return 0;
+    }
+    num_read = fread(magic, 8, 1, fh);
+    if (num_read != 1) {
+        fprintf(stderr, "Failed to read magic number from %s\n", fname);
+        fclose(fh);
+        return 0;
+    }
+    if (memcmp(magic, bcflat_magic, 8) != 0
+        && memcmp(magic, bcseq_magic, 8) != 0) {
+        struct image_info *info;
+        fclose(fh);
+        info = parse_image(fname);
+        if (!info)
+            return 0;
+        free_image_info(info);
+        return 1;
+    }
+
+    format_problem = 0;
+    if (memcmp(magic, bcseq_magic, 8) == 0)
+        is_ok = validate_bcseq(fh);
+    else
+        is_ok = validate_bcflat(fh);
+    fclose(fh);
+    free(flat_row_index);
+    flat_row_index = 0;
+    if (!is_ok) {
+        if (format_problem)
+            fprintf(stderr, "%s: invalid format, %s\n", fname, format_problem);
+        else
+            fprintf(stderr, "%s: invalid format\n", fname);
+    }
+    return is_ok;
+}
+
+/* Read just "num_rows" rows of an image starting with row "y0",
+   reporting problems like parse_image. Only BCFLAT and BCFLAT2
+   images can skip decoding the other rows; images in other formats
+   are read whole, and then the rows are cut out. Returns a pointer to
+   the new image, or a null pointer on failure. */
+struct image_info *parse_image_rows(const char *fname, long y0,
+                                    long num_rows) {
+    FILE *fh;
+    size_t num_read;
+    unsigned char magic[8];
+    struct image_info *info;
+
+    fh = fopen(fname, "rb");
+    if (!fh) {
+        fprintf(stderr, "Failed to open %s: %s\n", fname, strerror(errno));
+        return 0;
+    }
+    num_read = fread(magic, 8, 1, fh);
+    if (num_read != 1) {
+        fprintf(stderr, "Failed to read magic number from %s\n", fname);
+        fclose(fh);
+        return 0;
+    }
+
+    format_problem = 0;
+    if (memcmp(magic, bcflat_magic, 8) == 0) {
+        info = parse_bcflat_rows(fh, y0, num_rows);
+    } else if (memcmp(magic, bcflat2_magic, 8) == 0) {
+        info = parse_bcflat2_rows(fh, y0, num_rows);
+    } else {
+        rewind(fh);
+        info = parse_image_file(fh, fname);
+        if (!info) {
+            fclose(fh);
+            return 0;
+        }
+        if (y0 < 0 || num_rows < 1 || num_rows > info->height - y0) {
+            format_problem = "rows outside the image";
+            free_image_info(info);
+            info = 0;
+        } else {
+            memmove(info->pixels, info->pixels + 3 * y0 * info->width,
+                    3 * num_rows * info->width);
+            info->height = num_rows;
+        }
+    }
+    fclose(fh);
+    free(flat_row_index);
+    flat_row_index = 0;
+    if (!info) {
+        if (format_problem)
+            fprintf(stderr, "%s: invalid format, %s\n", fname, format_problem);
+        else
+            fprintf(stderr, "%s: invalid format\n", fname);
+    }
+    return info;
+}
+
+/* A BCPACK file holds many Badly Coded images, so that a large
+   collection can be read without opening a file for each image. After
+   the magic number come the number of members and the size of the
+   name table, each a 64-bit big-endian number, then the directory,
+   the name table, and the member images themselves, each an unchanged
+   image file. The directory has a PACK_ENTRY_SIZE entry per member,
+   sorted by name in the byte order of memcmp, made of 64-bit
+   big-endian numbers at these offsets:
+
+   PACK_NAME      offset of the member's name in the name table
+   PACK_NAME_LEN  length of the name, which is not NUL-terminated
+   PACK_OFFSET    offset of the image from the start of the file
+   PACK_LENGTH    size of the image
+   PACK_FORMAT    the image's magic number, as 8 bytes
+   PACK_WIDTH     width of the image
+   PACK_HEIGHT    height of the image
+
+   The format and size are copied from the image's header, so that a
+   pack can be listed without reading the images. */
+#define PACK_HEADER_SIZE 24
+#define PACK_ENTRY_SIZE 56
+#define PACK_NAME 0
+#define PACK_NAME_LEN 8
+#define PACK_OFFSET 16
+#define PACK_LENGTH 24
+#define PACK_FORMAT 32
+#define PACK_WIDTH 40
+#define PACK_HEIGHT 48
+
+/* An open BCPACK file. The whole file is mapped into memory, and
+   everything in the directory is checked when it is opened, so
+   members can be found and read without any further checks or system
+   calls. */
+struct image_pack {
+    const unsigned char *map;   /* the whole file */
+    long size;                  /* size of the file */
+    long num_members;
+    const unsigned char *dir;   /* the first directory entry */
+    const unsigned char *names; /* the name table */
+};
+
+/* Read field "field" of directory entry "i" of a pack. */
+long pack_field(const struct image_pack *pack, long i, int field) {
+    return load_u64_bigendian(pack->dir + i * PACK_ENTRY_SIZE + field);
+}
+
+/* Compare the name of member "i" of a pack with the "len" bytes of
+   "name", returning a negative, zero, or positive number like
+   memcmp. */
+int compare_pack_name(const struct image_pack *pack, long i,
+                      const char *name, long len) {
+    long member_len = pack_field(pack, i, PACK_NAME_LEN);
+    int cmp = memcmp(pack->names + pack_field(pack, i, PACK_NAME), name,
+                     member_len < len ? member_len : len);
+    if (cmp)
+        return cmp;
+    return member_len < len ? -1 : member_len > len;
+}
+
+/* Check the header and directory of a mapped pack, and fill in the
+   rest of "pack". Returns 1 on success, or 0 after setting
+   format_problem. */
+int check_pack(struct image_pack *pack) {
+    long names_size, i;
+
+    if (pack->size < PACK_HEADER_SIZE
+        || memcmp(pack->map, bcpack_magic, 8) != 0) {
+        format_problem = "not a BCPACK file";
+        return 0;
+    }
+    pack->num_members = load_u64_bigendian(pack->map + 8);
+    names_size = load_u64_bigendian(pack->map + 16);
+    if (pack->num_members < 0 || names_size < 0
+        || pack->num_members > (pack->size - PACK_HEADER_SIZE)
+                                / PACK_ENTRY_SIZE
+        || names_size > pack->size - PACK_HEADER_SIZE
+                        - pack->num_members * PACK_ENTRY_SIZE) {
+        format_problem = "directory too large for file";
+        return 0;
+    }
+    pack->dir = pack->map + PACK_HEADER_SIZE;
+    pack->names = pack->dir + pack->num_members * PACK_ENTRY_SIZE;
+    for (i = 0; i < pack->num_members; i++) {
+        long name = pack_field(pack, i, PACK_NAME);
+        long name_len = pack_field(pack, i, PACK_NAME_LEN);
+        long offset = pack_field(pack, i, PACK_OFFSET);
+        long length = pack_field(pack, i, PACK_LENGTH);
+        if (name < 0 || name_len < 0 || name > names_size
+            || name_len > names_size - name) {
+            format_problem = "member name outside name table";
+            return 0;
+        }
+        if (offset < 0 || length < 8 || offset > pack->size
+            || length > pack->size - offset) {
+            format_problem = "member outside file";
+            return 0;
+        }
+        if (i > 0 && compare_pack_name(pack, i - 1,
+                                       (const char *)pack->names + name,
+                                       name_len) >= 0) {
+            format_problem = "directory not sorted";
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/* Open the pack "fname" by mapping it into memory, reporting problems
+   like parse_image. Returns a pointer to the pack, or a null pointer
+   on failure. */
+struct image_pack *open_pack(const char *fname) {
+    struct image_pack *pack;
+    struct stat st;
+    void *map;
+    int fd = open(fname, O_RDONLY);
+
+    if (fd < 0) {
+        fprintf(stderr, "Failed to open %s: %s\n", fname, strerror(errno));
+        return 0;
+    }
+    if (fstat(fd, &st) != 0 || st.st_size == 0) {
+        fprintf(stderr, "%s: invalid format, empty file\n", fname);
+        close(fd);
+        return 0;
+    }
+    map = mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        fprintf(stderr, "Failed to map %s: %s\n", fname, strerror(errno));
+        return 0;
+    }
+    pack = xmalloc(sizeof(struct image_pack));
+    pack->map = map;
+    pack->size = st.st_size;
+    if (!check_pack(pack)) {
+        fprintf(stderr, "%s: invalid format, %s\n", fname, format_problem);
+        munmap(map, st.st_size);
+        free(pack);
+        return 0;
+    }
+    return pack;
+}
+
+/* Unmap and free a pack. */
+void close_pack(struct image_pack *pack) {
+    munmap((void *)pack->map, pack->size);
+    free(pack);
+}
+
+/* Find the member of a pack called "name" by binary search of the
+   directory. Returns its index, or -1 if there is no such member. */
+long find_pack_member(const struct image_pack *pack, const char *name) {
+    long lo = 0, hi = pack->num_members, len = strlen(name);
+    while (lo < hi) {
+        long mid = lo + (hi - lo) / 2;
+        int cmp = compare_pack_name(pack, mid, name, len);
+        if (cmp == 0)
+            return mid;
+        if (cmp < 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return -1;
+}
+
+/* Process the tagged data of an image held in memory, like
+   process_tagged_data, from byte *pos of the "size" bytes at "p",
+   leaving *pos just after the DATA tag. Returns 1 on success, or 0
+   after setting format_problem. */
+int process_tagged_buffer(const unsigned char *p, long size, long *pos,
+                          struct image_info *info,
+                          const unsigned char *magic) {
+    data_crc = -1;
+    for (;;) {
+        const unsigned char *ident = p + *pos, *value;
+        unsigned long tag_size;
+        int fits;
+        if (size - *pos < 4) {
+            format_problem = "short read of tag";
+            return 0;
+        }
+        *pos += 4;
+        if (!memcmp(ident, "DATA", 4))
+            return 1;
+        if (size - *pos < 8) {
+            format_problem = "short read of u64";
+            return 0;
+        }
+        tag_size = load_u64_bigendian(p + *pos);
+        *pos += 8;
+        if (tag_size > (1LL << 40)) {
+            format_problem = "tag too large";
+            return 0;
+        }
+        value = p + *pos;
+        fits = tag_size <= (unsigned long)(size - *pos);
+        if (!memcmp(ident, "TIME", 4)) {
+            if (tag_size != 8) {
+                format_problem = "wrong size for TIME";
+                return 0;
+            }
+            if (!fits) {
+                format_problem = "short read of u64";
+                return 0;
+            }
+            info->create_time = load_u64_bigendian(value);
+        } else if (!memcmp(ident, "DCRC", 4)) {
+            uint64_t crc;
+            if (tag_size != 8) {
+                format_problem = "wrong size for DCRC";
+                return 0;
+            }
+            if (!fits) {
+                format_problem = "short read of u64";
+                return 0;
+            }
+            crc = load_u64_bigendian(value);
+            if (crc > 0xffffffff) {
+                format_problem = "bad DCRC";
+                return 0;
+            }
+            data_crc = crc;
+        } else if (!memcmp(ident, "THMB", 4)) {
+            if (!fits) {
+                format_problem = "short read of THMB";
+                return 0;
+            }
+        } else if (!memcmp(ident, "FRMT", 4)) {
+            char *fmt_buf;
+            if (!fits) {
+                format_problem = "short read of format";
+                return 0;
+            }
+            fmt_buf = xmalloc(tag_size + 1);
+            memcpy(fmt_buf, value, tag_size);
+            fmt_buf[tag_size] = 0;
+            logging_fmt = fmt_buf;
+        } else if (!memcmp(ident, "RIDX", 4)
+                   && !memcmp(magic, bcflat_magic, 8)) {
+            long num_entries = 3 * info->height + 1;
+            if (info->height > size_limit || tag_size != 8 * num_entries) {
+                format_problem = "wrong size for RIDX";
+                return 0;
+            }
+            if (!fits) {
+                format_problem = "short read of RIDX";
+                return 0;
+            }
+            free(flat_row_index);
+            flat_row_index = xmalloc(tag_size);
+            if (!convert_flat_row_index(value, num_entries))
+                return 0;
+        } else {
+            format_problem = "unrecognized tag";
+            return 0;
+        }
+        *pos += tag_size;
+    }
+}
+
+/* Read a BCRAW image held in memory, the "size" bytes at "p" starting
+   with the magic number, like parse_bcraw. The pixels are copied
+   straight out of memory, and must all be there. Returns a pointer
+   to the image, or a null pointer after setting format_problem. */
+struct image_info *parse_bcraw_buffer(const unsigned char *p, long size) {
+    struct image_info *info;
+    long pos = 32;
+
+    if (size < 16) {
+        format_problem = "short read of flags";
+        return 0;
+    }
+    if (!check_bcraw_flags(p + 8))
+        return 0;
+    if (size < pos) {
+        format_problem = "short read of u64";
+        return 0;
+    }
+    info = xmalloc(sizeof(struct image_info));
+    info->width = load_u64_bigendian(p + 16);
+    info->height = load_u64_bigendian(p + 24);
+    info->pixels = 0;
+    info->create_time = -1;
+    info->cleanup = 0;
+    if (!process_tagged_buffer(p, size, &pos, info, bcraw_magic)) {
+        free(info);
+        return 0;
+    }
+    if (info->width < 0 || info->height < 0 || (info->width
+            && info->height > (size - pos) / 3 / info->width)) {
+        format_problem = "short read of raw data";
+        free(info);
+        return 0;
+    }
+    if (data_crc != -1 && crc32c(0, p + pos, size - pos) != data_crc) {
+        format_problem = "checksum mismatch";
+        free(info);
+        return 0;
+    }
+    info->pixels = xmalloc(3 * info->width * info->height);
+    memcpy(info->pixels, p + pos, 3 * info->width * info->height);
+    return info;
+}
+
+/* Decode the compressed samples of a BCFLAT image held in memory,
+   the "size" bytes at "data", into "info", choosing between the same
+   ways of decoding as read_flat_data. The samples must be followed
+   by at least FLAT_PAD bytes that can be read. Returns 1 on success,
+   or 0 after setting format_problem. */
+int decode_flat_buffer(unsigned char *data, long size,
+                       struct image_info *info) {
+    int num_threads = 1, c, is_ok = 1, crc_first;
+    long *row_start, pos = 0, y;
+    init_flat_codes();
+    if (flat_row_index && !check_flat_row_index(flat_row_index, info))
+        return 0;
+    /* Finding the number of processors takes longer than decoding a
+       small image */
+    if (3 * info->width * info->height >= FLAT_PARALLEL_MIN)
+        num_threads = flat_thread_count();
+    /* The checksum is checked when read_flat_data would check it, so
+       that a bad image is described the same way */
+    crc_first = flat_row_index || num_threads > 1;
+    if (crc_first && data_crc != -1 && crc32c(0, data, size) != data_crc) {
+        format_problem = "checksum mismatch";
+        return 0;
+    }
+    if (flat_row_index) {
+        if (flat_row_index[3 * info->height] > size) {
+            format_problem = "too little data";
+            return 0;
+        }
+        is_ok = decode_flat_rows_parallel(info, data, flat_row_index,
+                                          num_threads);
+    } else if (num_threads > 1) {
+        row_start = guess_flat_rows(data, size, info->width, info->height,
+                                    num_threads);
+        is_ok = row_start
+            && decode_flat_rows_parallel(info, data, row_start,
+                                         num_threads);
+        free(row_start);
+    } else {
+        for (c = 0; c < 3 && is_ok; c++) {
+            for (y = 0; y < info->height && is_ok; y++) {
+                const char *problem = 0;
+                unsigned char *row = info->pixels + 3 * y * info->width;
+                long len = decode_flat_row(data + pos, size - pos, row + c,
+                                           3, info->width, &problem);
+                if (len < 0) {
+                    format_problem = problem;
+                    is_ok = 0;
+                } else {
+                    pos += len;
+                }
+            }
+        }
+    }
+    if (is_ok && !crc_first && data_crc != -1
+        && crc32c(0, data, size) != data_crc) {
+        format_problem = "checksum mismatch";
+        is_ok = 0;
+    }
+    return is_ok;
+}
+
+/* Read a plain BCFLAT image held in memory, the "size" bytes at "p"
+   starting with the magic number, like parse_bcflat, decoding it
+   straight out of memory. The image must be followed by at least
+   FLAT_PAD bytes that can be read. Returns a pointer to the image, or
+   a null pointer after setting format_problem. */
+struct image_info *parse_bcflat_buffer(const unsigned char *p, long size) {
+    struct image_info *info;
+    long width, height, pos = 32;
+
+    if (size < 16) {
+        format_problem = "short read of flags";
+        return 0;
+    }
+    if (!check_bcflat_flags(p + 8))
+        return 0;
+    if (size < pos) {
+        format_problem = "short read of u64";
+        return 0;
+    }
+    width = load_u64_bigendian(p + 16);
+    height = load_u64_bigendian(p + 24);
+    if (!check_bcflat_size(width, height))
+        return 0;
+    info = xmalloc(sizeof(struct image_info));
+    info->width = width;
+    info->height = height;
+    info->pixels = 0;
+    info->create_time = -1;
+    info->cleanup = 0;
+    if (!process_tagged_buffer(p, size, &pos, info, bcflat_magic)) {
+        free(info);
+        return 0;
+    }
+    info->pixels = xmalloc(3 * width * height);
+    if (!decode_flat_buffer((unsigned char *)p + pos, size - pos, info)) {
+        free(info->pixels);
+        free(info);
+        return 0;
+    }
+    return info;
+}
+
+/* Read an image held in memory, the "size" bytes at "p", with stdio
+   through fmemopen, exactly as parse_image_file reads a file.
+   Returns a pointer to the image, or a null pointer on failure. */
+struct image_info *parse_image_memfile(const unsigned char *p, long size,
+                                       const char *fname) {
+    struct image_info *info;
+    FILE *fh = fmemopen((void *)p, size, "rb");
+    if (!fh) {
+        fprintf(stderr, "Failed to open %s: %s\n", fname, strerror(errno));
+        return 0;
+    }
+    info = parse_image_file(fh, fname);
+    fclose(fh);
+    return info;
+}
+
+/* Read an image held in memory, the "size" bytes at "p", reporting
+   problems like parse_image_file under the name "fname". BCRAW and
+   plain BCFLAT images are decoded straight out of memory, which must
+   have at least FLAT_PAD bytes that can be read after the image;
+   other formats, which only have decoders for files, go through
+   parse_image_memfile. Returns a pointer to the image, or a null
+   pointer on failure. */
+struct image_info *parse_image_buffer(const unsigned char *p, long size,
+                                      const char *fname) {
+    struct image_info *info;
+
+    if (size < 8) {
+        fprintf(stderr, "Failed to read magic number from %s\n", fname);
+        return 0;
+    }
+    format_problem = 0;
+    if (memcmp(p, bcraw_magic, 8) == 0)
+        info = parse_bcraw_buffer(p, size);
+    else if (memcmp(p, bcflat_magic, 8) == 0
+             && (size < 16 || !flat_variant(p + 8)))
+        info = parse_bcflat_buffer(p, size);
+    else
+        return parse_image_memfile(p, size, fname);
+
+    /* A row index is only used while decoding the image it came
+       with. */
+    free(flat_row_index);
+    flat_row_index = 0;
+
+    if (!info) {
+        if (format_problem)
+            fprintf(stderr, "%s: invalid format, %s\n", fname, format_problem);
+        else
+            fprintf(stderr, "%s: invalid format\n", fname);
+    }
+    return info;
+}
+
+/* Read member "i" of a pack, straight out of the mapped file, into
+   our internal format, reporting problems like parse_image under the
+   name "name". The BCFLAT decoder looks up to FLAT_PAD bytes past the
+   end of the data, so a BCFLAT member with less than that after it in
+   the file is read with parse_image_memfile instead. Returns a
+   pointer to the image, or a null pointer on failure. */
+struct image_info *parse_pack_member(const struct image_pack *pack, long i,
+                                     const char *name) {
+    long offset = pack_field(pack, i, PACK_OFFSET);
+    long length = pack_field(pack, i, PACK_LENGTH);
+    const unsigned char *p = pack->map + offset;
+    if (pack->size - offset - length < FLAT_PAD
+        && memcmp(p, bcflat_magic, 8) == 0)
+        return parse_image_memfile(p, length, name);
+    return parse_image_buffer(p, length, name);
+}
+
+/* Read the member of a pack called "name", reporting problems like
+   parse_image. Returns a pointer to the image, or a null pointer on
+   failure, including when there is no such member. */
+struct image_info *parse_pack_image(const struct image_pack *pack,
+                                    const char *name) {
+    long i = find_pack_member(pack, name);
+    if (i == -1) {
+        fprintf(stderr, "%s: not in pack\n", name);
+        return 0;
+    }
+    return parse_pack_member(pack, i, name);
+}
+
+/* BCFLAT encoding is the decoder run backwards, and is arranged to do
+   as much as possible of the work on many samples at once:
+
+   1. The differences between each sample and the one before it in
+      the same channel are computed for a whole row of pixels at a
+      time. In an interleaved row, the sample before row[i] in its
+      channel is row[i - 3], so this is one long vector subtraction,
+      after which the differences are split into three planes the
+      same way merge_planes joins them.
+   2. Consecutive equal differences can share a codeword, so each
+      plane is compared against itself shifted by one sample, giving
+      a bitmap of where each run of equal differences ends.
+   3. Each run is then turned into codewords by table lookups, and
+      the codewords are packed into a shift register, which is stored
+      8 bytes at a time.
+
+   The rows are divided into tasks of FLAT_ROWS_PER_TASK rows, like
+   in flat_decode_worker, that are encoded by separate threads, and
+   the rows of each channel are concatenated at the end. */
+
+/* How to write one codeword: its bits, at the bottom of "bits", and
+   its length. */
+struct flat_code_bits {
+    unsigned short bits;
+    unsigned char len;
+};
+
+/* flat_enc_codes[num][d] is the shortest codeword for "num" samples
+   that all have difference "d" (as an unsigned byte), or has length
+   0 if there is none. flat_enc_max_num[d] is the largest number of
+   samples any codeword for "d" covers. These are worked out from
+   flat_codes, so the encoder can't disagree with the decoder. */
+struct flat_code_bits flat_enc_codes[EXPANSION + 1][256];
+unsigned char flat_enc_max_num[256];
+
+/* Fill in flat_enc_codes and flat_enc_max_num, if that hasn't been
+   done already. */
+void init_flat_encoder(void) {
+    static int initialized;
+    unsigned int bits;
+    if (initialized)
+        return;
+    init_flat_codes();
+    /* Every codeword appears in flat_codes once for each possible
+       value of the bits after it; the first one found is kept, which
+       for the reserved 1111xxx codewords is 1111000. */
+    for (bits = 0; bits < (1 << FLAT_CODE_BITS); bits++) {
+        struct flat_code code = flat_codes[bits];
+        unsigned char d = code.diff;
+        struct flat_code_bits *enc = &flat_enc_codes[code.num][d];
+        if (!enc->len || code.codelen < enc->len) {
+            enc->bits = bits >> (FLAT_CODE_BITS - code.codelen);
+            enc->len = code.codelen;
+        }
+        if (code.num > flat_enc_max_num[d])
+            flat_enc_max_num[d] = code.num;
+    }
+    initialized = 1;
+}
+
+/* Output side of the shift register: codewords are added below the
+   bits already in "reg", and once it holds too many bits for another
+   codeword (up to FLAT_LONG_RUN_BITS) to be sure to fit, all of its
+   whole bytes are stored at once. The store is always 8 bytes, so
+   there must be room for 8 bytes past the end of the compressed
+   row. */
+struct flat_bit_writer {
+    uint64_t reg;       /* bits not yet stored, at the top */
+    int reg_size;       /* number of bits in the register */
+    unsigned char *q;   /* where the bits in reg go */
+};
+
+static inline void put_flat_code(struct flat_bit_writer *w,
+                                 struct flat_code_bits code) {
+    w->reg |= (uint64_t)code.bits << (64 - w->reg_size - code.len);
+    w->reg_size += code.len;
+    if (w->reg_size >= 64 - FLAT_LONG_RUN_BITS) {
+        store_u64_bigendian(w->q, w->reg);
+        w->q += w->reg_size >> 3;
+        w->reg <<= w->reg_size & ~7;
+        w->reg_size &= 7;
+    }
+}
+
+/* Write codewords for "n" samples that all have difference "d",
+   using the long run codeword of the codec variant if "long_runs" is
+   set. That only saves bits from 24 zeros on. */
+static inline void put_flat_run(struct flat_bit_writer *w, unsigned char d,
+                                long n, int long_runs) {
+    int max_num = flat_enc_max_num[d];
+    while (long_runs && d == 0 && n >= 24) {
+        long blocks = n / 8 < 256 ? n / 8 : 256;
+        struct flat_code_bits code;
+        code.bits = FLAT_LONG_RUN_CODE << 8 | (blocks - 1);
+        code.len = FLAT_LONG_RUN_BITS;
+        put_flat_code(w, code);
+        n -= 8 * blocks;
+    }
+    while (n > 0) {
+        int num = n < max_num ? n : max_num;
+        /* For some differences, two pairs are shorter than three
+           samples and one */
+        if (num == 3 && n == 4
+            && flat_enc_codes[3][d].len + flat_enc_codes[1][d].len
+               > 2 * flat_enc_codes[2][d].len)
+            num = 2;
+        put_flat_code(w, flat_enc_codes[num][d]);
+        n -= num;
+    }
+}
+
+/* Scratch space after each plane of differences, so that the vector
+   loops in find_flat_runs can read a whole block past the end. */
+#define FLAT_ENCODE_SLACK 80
+
+/* Store differences between the samples of an interleaved row of
+   "num" bytes and their predictions into "diffs", from byte "start"
+   on. The prediction is the sample 3 bytes (one pixel) before, the
+   one in the row above, "up", or their average, as selected by
+   "predictor" (one of the FLAT_PREDICT_ values); if up is a null
+   pointer it is always the sample before. The first pixel is copied
+   unchanged, since that is how rows start. */
+void diff_pixels_scalar(const unsigned char *row, const unsigned char *up,
+                        unsigned char *diffs, long num, long start,
+                        int predictor) {
+    long i;
+    if (!up)
+        predictor = FLAT_PREDICT_LEFT;
+    for (i = start; i < num; i++) {
+        if (i < 3)
+            diffs[i] = row[i];
+        else if (predictor == FLAT_PREDICT_LEFT)
+            diffs[i] = row[i] - row[i - 3];
+        else if (predictor == FLAT_PREDICT_UP)
+            diffs[i] = row[i] - up[i];
+        else
+            diffs[i] = row[i] - ((row[i - 3] + up[i] + 1) >> 1);
+    }
+}
+
+/* Split "num" interleaved pixels into three planes; the opposite of
+   merge_planes. */
+void split_planes_scalar(const unsigned char *pixels, unsigned char *r,
+                         unsigned char *g, unsigned char *b, long num) {
+    long i;
+    for (i = 0; i < num; i++) {
+        r[i] = pixels[3*i + 0];
+        g[i] = pixels[3*i + 1];
+        b[i] = pixels[3*i + 2];
+    }
+}
+
+/* Set bit x (counting from the bottom of each word) of "ends" for
+   each x < num where diffs[x] is different from diffs[x + 1], so the
+   run of equal differences it is part of ends there. Whole 64-bit
+   words are stored, and the bits past "num" are meaningless. */
+void find_flat_runs_scalar(const unsigned char *diffs, uint64_t *ends,
+                           long num) {
+    long x;
+    for (x = 0; x < num; x += 64) {
+        uint64_t word = 0;
+        int k;
+        for (k = 0; k < 64; k++)
+            word |= (uint64_t)(diffs[x + k] != diffs[x + k + 1]) << k;
+        ends[x >> 6] = word;
+    }
+}
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+/* SSE2 version of diff_pixels_scalar, 16 bytes at a time. The
+   average is rounded up just like _mm_avg_epu8 does it. */
+__attribute__((target("sse2")))
+void diff_pixels_sse2(const unsigned char *row, const unsigned char *up,
+                      unsigned char *diffs, long num, int predictor) {
+    long i;
+    if (!up)
+        predictor = FLAT_PREDICT_LEFT;
+    diff_pixels_scalar(row, up, diffs, num < 3 ? num : 3, 0, predictor);
+    for (i = 3; i + 16 <= num; i += 16) {
+        __m128i cur = _mm_loadu_si128((__m128i *)(row + i));
+        __m128i pred = _mm_loadu_si128((__m128i *)(row + i - 3));
+        if (predictor != FLAT_PREDICT_LEFT) {
+            __m128i above = _mm_loadu_si128((__m128i *)(up + i));
+            pred = predictor == FLAT_PREDICT_UP
+                ? above : _mm_avg_epu8(pred, above);
+        }
+        _mm_storeu_si128((__m128i *)(diffs + i), _mm_sub_epi8(cur, pred));
+    }
+    diff_pixels_scalar(row, up, diffs, num, i, predictor);
+}
+
+/* SSSE3 version of split_planes_scalar, the same shuffles as
+   merge_planes_ssse3 in the other direction. */
+__attribute__((target("ssse3")))
+void split_planes_ssse3(const unsigned char *pixels, unsigned char *r,
+                        unsigned char *g, unsigned char *b, long num) {
+    /* mask[k][c] picks the samples of channel c out of input block
+       k, and zeros (index 0x80) for the samples in other blocks. */
+    unsigned char masks[3][3][16];
+    __m128i mask[3][3];
+    long i;
+    int j, k, c;
+    for (k = 0; k < 3; k++) {
+        for (c = 0; c < 3; c++) {
+            for (j = 0; j < 16; j++) {
+                int in = 3*j + c;
+                masks[k][c][j] = in / 16 == k ? in % 16 : 0x80;
+            }
+            mask[k][c] = _mm_loadu_si128((__m128i *)masks[k][c]);
+        }
+    }
+    for (i = 0; i + 16 <= num; i += 16) {
+        __m128i in[3], out[3];
+        for (k = 0; k < 3; k++)
+            in[k] = _mm_loadu_si128((__m128i *)(pixels + 3*i + 16*k));
+        for (c = 0; c < 3; c++)
+            out[c] = _mm_or_si128(
+                _mm_or_si128(_mm_shuffle_epi8(in[0], mask[0][c]),
+                             _mm_shuffle_epi8(in[1], mask[1][c])),
+                _mm_shuffle_epi8(in[2], mask[2][c]));
+        _mm_storeu_si128((__m128i *)(r + i), out[0]);
+        _mm_storeu_si128((__m128i *)(g + i), out[1]);
+        _mm_storeu_si128((__m128i *)(b + i), out[2]);
+    }
+    split_planes_scalar(pixels + 3*i, r + i, g + i, b + i, num - i);
+}
+
+/* SSE2 version of find_flat_runs_scalar: each comparison of 16
+   differences with their neighbors gives 16 bits of the bitmap. */
+__attribute__((target("sse2")))
+void find_flat_runs_sse2(const unsigned char *diffs, uint64_t *ends,
+                         long num) {
+    long x;
+    for (x = 0; x < num; x += 64) {
+        uint64_t word = 0;
+        int k;
+        for (k = 0; k < 64; k += 16) {
+            __m128i cur = _mm_loadu_si128((__m128i *)(diffs + x + k));
+            __m128i next = _mm_loadu_si128((__m128i *)(diffs + x + k + 1));
+            unsigned int same = _mm_movemask_epi8(_mm_cmpeq_epi8(cur, next));
+            word |= (uint64_t)(~same & 0xffff) << k;
+        }
+        ends[x >> 6] = word;
+    }
+}
+#endif
+
+/* Dispatchers for the functions above, using the vector versions if
+   the processor supports them. */
+void diff_pixels(const unsigned char *row, const unsigned char *up,
+                 unsigned char *diffs, long num, int predictor) {
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+    if (__builtin_cpu_supports("sse2")) {
+        diff_pixels_sse2(row, up, diffs, num, predictor);
+        return;
+    }
+#endif
+    diff_pixels_scalar(row, up, diffs, num, 0, predictor);
+}
+
+void split_planes(const unsigned char *pixels, unsigned char *r,
+                  unsigned char *g, unsigned char *b, long num) {
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+    if (__builtin_cpu_supports("ssse3")) {
+        split_planes_ssse3(pixels, r, g, b, num);
+        return;
+    }
+#endif
+    split_planes_scalar(pixels, r, g, b, num);
+}
+
+void find_flat_runs(const unsigned char *diffs, uint64_t *ends, long num) {
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+    if (__builtin_cpu_supports("sse2")) {
+        find_flat_runs_sse2(diffs, ends, num);
+        return;
+    }
+#endif
+    find_flat_runs_scalar(diffs, ends, num);
+}
+
+/* Return the position of the first run end at or after "x" in the
+   bitmap from find_flat_runs. There must be one. */
+static inline long next_flat_run_end(const uint64_t *ends, long x) {
+    uint64_t word = ends[x >> 6] >> (x & 63);
+    while (!word) {
+        x = (x | 63) + 1;
+        word = ends[x >> 6];
+    }
+#ifdef __GNUC__
+    return x + __builtin_ctzll(word);
+#else
+    while (!(word & 1)) {
+        word >>= 1;
+        x++;
+    }
+    return x;
+#endif
+}
+
+/* Encode one row of one channel, given as the first sample followed
+   by the differences for the rest of the "width" samples, with the
+   run bitmap from find_flat_runs in "ends", into "out", with long
+   run codewords if "long_runs" is set. There must be room for
+   flat_row_limit(width) + 8 bytes. Returns the number of bytes in the
+   compressed row. */
+long encode_flat_row(const unsigned char *diffs, uint64_t *ends,
+                     long width, int long_runs, unsigned char *out) {
+    struct flat_bit_writer w;
+    long x = 1;
+    /* The last sample always ends a run */
+    ends[(width - 1) >> 6] |= (uint64_t)1 << ((width - 1) & 63);
+    out[0] = diffs[0];
+    w.reg = 0;
+    w.reg_size = 0;
+    w.q = out + 1;
+    while (x < width) {
+        long end = next_flat_run_end(ends, x);
+        put_flat_run(&w, diffs[x], end + 1 - x, long_runs);
+        x = end + 1;
+    }
+    /* Any partial byte is padded with zeros */
+    store_u64_bigendian(w.q, w.reg);
+    w.q += (w.reg_size + 7) >> 3;
+    return w.q - out;
+}
+
+/* Work shared between the threads encoding one image. The compressed
+   data of task t is in task_data[t], with its rows of channel 0 first,
+   then those of channel 1 and 2; the length of every row is stored in
+   row_size, in the same order as in a row index. */
+struct flat_encode_job {
+    struct image_info *info;
+    int predictor;          /* FLAT_PREDICT_ value for the codec */
+    int long_runs;          /* whether to use long run codewords */
+    unsigned char **task_data;
+    long *row_size;
+    pthread_mutex_t lock;   /* protects next_task */
+    long next_task;         /* first task not yet handed out */
+    long num_tasks;
+};
+
+/* Thread body: repeatedly take the next FLAT_ROWS_PER_TASK rows of the
+   image and encode all three channels of them. */
+void *flat_encode_worker(void *arg) {
+    struct flat_encode_job *job = arg;
+    struct image_info *info = job->info;
+    long width = info->width, height = info->height;
+    long limit = flat_row_limit(width) + 8;
+    long plane_size = width + FLAT_ENCODE_SLACK;
+    unsigned char *diffs = xmalloc(3 * width);
+    unsigned char *planes = xmalloc(3 * plane_size);
+    uint64_t *ends = xmalloc((width / 64 + 1) * sizeof(uint64_t));
+    /* The bytes after each plane are only looked at by the run
+       comparison, but should still be initialized */
+    memset(planes, 0, 3 * plane_size);
+    for (;;) {
+        long t, y, y_start, y_end, c;
+        unsigned char *data, *chan_end[3];
+        pthread_mutex_lock(&job->lock);
+        t = job->next_task++;
+        pthread_mutex_unlock(&job->lock);
+        if (t >= job->num_tasks)
+            break;
+        y_start = t * FLAT_ROWS_PER_TASK;
+        y_end = y_start + FLAT_ROWS_PER_TASK;
+        if (y_end > height)
+            y_end = height;
+        /* Room for each channel's rows at their longest, to be
+           packed together afterwards */
+        data = xmalloc(3 * (y_end - y_start) * limit);
+        for (c = 0; c < 3; c++)
+            chan_end[c] = data + c * (y_end - y_start) * limit;
+        for (y = y_start; y < y_end; y++) {
+            unsigned char *row = info->pixels + 3 * y * width;
+            diff_pixels(row, y > 0 ? row - 3 * width : 0, diffs, 3 * width,
+                        job->predictor);
+            split_planes(diffs, planes, planes + plane_size,
+                         planes + 2 * plane_size, width);
+            for (c = 0; c < 3; c++) {
+                unsigned char *plane = planes + c * plane_size;
+                long size;
+                find_flat_runs(plane, ends, width);
+                size = encode_flat_row(plane, ends, width, job->long_runs,
+                                       chan_end[c]);
+                chan_end[c] += size;
+                job->row_size[c * height + y] = size;
+            }
+        }
+        for (c = 1; c < 3; c++) {
+            unsigned char *chan_start = data + c * (y_end - y_start) * limit;
+            memmove(chan_end[c - 1], chan_start, chan_end[c] - chan_start);
+            chan_end[c] = chan_end[c - 1] + (chan_end[c] - chan_start);
+        }
+        job->task_data[t] = realloc(data, chan_end[2] - data);
+        if (!job->task_data[t])
+            job->task_data[t] = data;
+    }
+    free(diffs);
+    free(planes);
+    free(ends);
+    return 0;
+}
+
+/* Encode the pixels of "info" as BCFLAT compressed data, using
+   flat_thread_count() threads for large images. "predictor" and
+   "long_runs" select the codec variant, as in flags[5] and flags[4]
+   of the header; both 0 for plain BCFLAT. The data is stored in a
+   newly allocated buffer in *data_out, followed by FLAT_PAD bytes of
+   zero padding. Returns a newly allocated array of where each row
+   starts, in the same format as flat_row_index. */
+long *encode_flat_rows(struct image_info *info, int predictor, int long_runs,
+                       unsigned char **data_out) {
+    struct flat_encode_job job;
+    long height = info->height, num_rows = 3 * height;
+    long *row_start = xmalloc((num_rows + 1) * sizeof(long));
+    unsigned char *data, *q;
+    int num_threads = flat_thread_count();
+    pthread_t *threads;
+    long r, t;
+    int c, i, num_started = 0;
+
+    init_flat_encoder();
+    job.info = info;
+    job.predictor = predictor;
+    job.long_runs = long_runs;
+    job.num_tasks = (height + FLAT_ROWS_PER_TASK - 1) / FLAT_ROWS_PER_TASK;
+    job.task_data = xmalloc(job.num_tasks * sizeof(unsigned char *));
+    job.row_size = xmalloc(num_rows * sizeof(long));
+    job.next_task = 0;
+    pthread_mutex_init(&job.lock, 0);
+    if (3 * info->width * height < FLAT_PARALLEL_MIN)
+        num_threads = 1;
+    threads = xmalloc(num_threads * sizeof(pthread_t));
+    for (i = 1; i < num_threads; i++) {
+        if (pthread_create(&threads[num_started], 0, flat_encode_worker,
+                           &job) != 0)
+            break;  /* the threads we already have can do the work */
+        num_started++;
+    }
+    flat_encode_worker(&job);
+    for (i = 0; i < num_started; i++)
+        pthread_join(threads[i], 0);
+    pthread_mutex_destroy(&job.lock);
+    free(threads);
+
+    row_start[0] = 0;
+    for (r = 0; r < num_rows; r++)
+        row_start[r + 1] = row_start[r] + job.row_size[r];
+    data = xmalloc(row_start[num_rows] + FLAT_PAD);
+    memset(data + row_start[num_rows], 0, FLAT_PAD);
+    /* Gather each channel's rows from all the tasks */
+    q = data;
+    for (c = 0; c < 3; c++) {
+        for (t = 0; t < job.num_tasks; t++) {
+            long y_start = t * FLAT_ROWS_PER_TASK;
+            long y_end = y_start + FLAT_ROWS_PER_TASK < height
+                ? y_start + FLAT_ROWS_PER_TASK : height;
+            long offset = 0, size;
+            int c2;
+            for (c2 = 0; c2 < c; c2++)
+                offset += row_start[c2 * height + y_end]
+                    - row_start[c2 * height + y_start];
+            size = row_start[c * height + y_end]
+                - row_start[c * height + y_start];
+            memcpy(q, job.task_data[t] + offset, size);
+            q += size;
+        }
+    }
+    for (t = 0; t < job.num_tasks; t++)
+        free(job.task_data[t]);
+    free(job.task_data);
+    free(job.row_size);
+    *data_out = data;
+    return row_start;
+}
+
+/* BCPROG images store each pixel as one of the 216 colors of the
+   6x6x6 "web safe" palette, whose levels are multiples of 51. Rather
+   than dividing every sample by 51, the nearest level for each of
+   the 256 sample values is looked up, already multiplied by the
+   weight of its channel in the packed byte (36 for red, 6 for green,
+   1 for blue), so a pixel is three lookups and two additions. */
+unsigned char prog_levels[3][256];
+
+/* Fill in prog_levels, if that hasn't been done already. */
+void init_prog_levels(void) {
+    static int initialized;
+    int v;
+    if (initialized)
+        return;
+    for (v = 0; v < 256; v++) {
+        int level = (v + 25) / 51;
+        prog_levels[0][v] = 36 * level;
+        prog_levels[1][v] = 6 * level;
+        prog_levels[2][v] = level;
+    }
+    initialized = 1;
+}
+
+/* Optionally, the rounding error of each sample can be spread to its
+   neighbors to the right and below (Floyd-Steinberg error diffusion),
+   which keeps the average color of an area closer to the original.
+   That makes each row depend on the one before, so the image is
+   dithered in separate bands of PROG_BAND_ROWS rows that can be
+   handled by different threads. The band size doesn't depend on the
+   number of threads, so the result is always the same. */
+#define PROG_BAND_ROWS 32
+
+/* Work shared between the threads quantizing one image into
+   "packed", one byte per pixel. */
+struct prog_quantize_job {
+    struct image_info *info;
+    unsigned char *packed;
+    int dither;
+    pthread_mutex_t lock;   /* protects next_band */
+    long next_band;         /* first band not yet handed out */
+    long num_bands;
+};
+
+/* Quantize rows "y_start" up to "y_end" of an image without
+   dithering. */
+void quantize_prog_rows(struct image_info *info, unsigned char *packed,
+                        long y_start, long y_end) {
+    unsigned char *p = info->pixels + 3 * y_start * info->width;
+    unsigned char *q = packed + y_start * info->width;
+    long i, num = (y_end - y_start) * info->width;
+    for (i = 0; i < num; i++) {
+        q[i] = prog_levels[0][p[0]] + prog_levels[1][p[1]]
+            + prog_levels[2][p[2]];
+        p += 3;
+    }
+}
+
+/* Quantize rows "y_start" up to "y_end" of an image with error
+   diffusion, starting with no error from above. "err" must have
+   room for 6 * (width + 2) ints: the errors, in sixteenths, carried
+   into this row and the next, with a spare pixel at each end. */
+void dither_prog_rows(struct image_info *info, unsigned char *packed,
+                      long y_start, long y_end, int *err) {
+    long width = info->width, x, y;
+    int *cur = err, *next = err + 3 * (width + 2);
+    memset(next, 0, 3 * (width + 2) * sizeof(int));
+    for (y = y_start; y < y_end; y++) {
+        unsigned char *p = info->pixels + 3 * y * width;
+        unsigned char *q = packed + y * width;
+        int *tmp = cur;
+        cur = next;
+        next = tmp;
+        memset(next, 0, 3 * (width + 2) * sizeof(int));
+        for (x = 0; x < width; x++) {
+            int c, pixel = 0;
+            for (c = 0; c < 3; c++) {
+                int i = 3 * (x + 1) + c;
+                int v = p[3 * x + c] + ((cur[i] + 8) >> 4);
+                int level, e;
+                v = v < 0 ? 0 : v > 255 ? 255 : v;
+                level = prog_levels[2][v];
+                e = v - 51 * level;
+                cur[i + 3] += 7 * e;
+                next[i - 3] += 3 * e;
+                next[i] += 5 * e;
+                next[i + 3] += e;
+                pixel = 6 * pixel + level;
+            }
+            q[x] = pixel;
+        }
+    }
+}
+
+/* Thread body: repeatedly take the next band of the image and
+   quantize it. */
+void *prog_quantize_worker(void *arg) {
+    struct prog_quantize_job *job = arg;
+    struct image_info *info = job->info;
+    int *err = job->dither ? xmalloc(6 * (info->width + 2) * sizeof(int)) : 0;
+    for (;;) {
+        long band, y_start, y_end;
+        pthread_mutex_lock(&job->lock);
+        band = job->next_band++;
+        pthread_mutex_unlock(&job->lock);
+        if (band >= job->num_bands)
+            break;
+        y_start = band * PROG_BAND_ROWS;
+        y_end = y_start + PROG_BAND_ROWS;
+        if (y_end > info->height)
+            y_end = info->height;
+        if (job->dither)
+            dither_prog_rows(info, job->packed, y_start, y_end, err);
+        else
+            quantize_prog_rows(info, job->packed, y_start, y_end);
+    }
+    free(err);
+    return 0;
+}
+
+/* Convert the pixels of "info" to the BCPROG palette, one byte per
+   pixel in normal row order, with error diffusion if "dither" is
+   set. Uses flat_thread_count() threads for large images. Returns a
+   newly allocated buffer of width * height bytes. */
+unsigned char *quantize_prog(struct image_info *info, int dither) {
+    struct prog_quantize_job job;
+    int num_threads = flat_thread_count();
+    pthread_t *threads;
+    int i, num_started = 0;
+
+    init_prog_levels();
+    job.info = info;
+    job.packed = xmalloc(info->width * info->height);
+    job.dither = dither;
+    job.next_band = 0;
+    job.num_bands = (info->height + PROG_BAND_ROWS - 1) / PROG_BAND_ROWS;
+    pthread_mutex_init(&job.lock, 0);
+    if (3 * info->width * info->height < FLAT_PARALLEL_MIN)
+        num_threads = 1;
+    threads = xmalloc(num_threads * sizeof(pthread_t));
+    for (i = 1; i < num_threads; i++) {
+        if (pthread_create(&threads[num_started], 0, prog_quantize_worker,
+                           &job) != 0)
+            break;  /* the threads we already have can do the work */
+        num_started++;
+    }
+    prog_quantize_worker(&job);
+    for (i = 0; i < num_started; i++)
+        pthread_join(threads[i], 0);
+    pthread_mutex_destroy(&job.lock);
+    free(threads);
+    return job.packed;
+}
+
+/* A Badly Coded image file can carry a small thumbnail of the image
+   in a THMB tag, so that a preview can be shown after reading just
+   the header and tags, without decoding the image itself. The tag
+   holds three big-endian 64-bit numbers, the width and height of the
+   thumbnail and its depth, followed by its pixels in rows from top to
+   bottom:
+
+   depth 8     3 bytes per pixel, red, green and blue, as in BCRAW
+   depth 0xd8  1 byte per pixel from the BCPROG palette
+
+   Each side of a thumbnail can be at most THMB_MAX_SIZE pixels. */
+#define THMB_MAX_SIZE 1024
+
+/* Read the contents of a THMB tag of "size" bytes from "fh" into a
+   new image. Returns a pointer to the image, or a null pointer after
+   setting format_problem. */
+struct image_info *read_thumbnail_tag(FILE *fh, unsigned long size) {
+    struct image_info *info;
+    long width, height, depth, bytes_per_pixel, y;
+
+    width = read_u64_bigendian(fh);
+    height = read_u64_bigendian(fh);
+    depth = read_u64_bigendian(fh);
+    if (width == -1 || height == -1 || depth == -1)
+        return 0;
+    if (width < 1 || height < 1 || width > THMB_MAX_SIZE
+        || height > THMB_MAX_SIZE) {
+        format_problem = "bad thumbnail size";
+        return 0;
+    }
+    if (depth != 8 && depth != 0xd8) {
+        format_problem = "unsupported thumbnail depth";
+        return 0;
+    }
+    bytes_per_pixel = depth == 8 ? 3 : 1;
+    if (size != 24 + bytes_per_pixel * width * height) {
+        format_problem = "wrong size for THMB";
+        return 0;
+    }
+
+    info = xmalloc(sizeof(struct image_info));
+    info->width = width;
+    info->height = height;
+    info->create_time = -1;
+    info->cleanup = 0;
+    info->pixels = xmalloc(3 * width * height);
+    /* Packed rows are read into the start of where their pixels go,
+       and expanded in place */
+    for (y = 0; y < height; y++) {
+        unsigned char *row = info->pixels + 3 * y * width;
+        if (fread(row, bytes_per_pixel * width, 1, fh) != 1) {
+            format_problem = "short read of THMB";
+            free_image_info(info);
+            return 0;
+        }
+        if (depth == 0xd8 && !expand_prog_row(row, width)) {
+            free_image_info(info);
+            return 0;
+        }
+    }
+    return info;
+}
+
+/* Read the header of an image in the format given by "magic", which
+   has already been read, leaving "fh" at the start of the tags.
+   Returns 1 on success, or 0 after setting format_problem. */
+int skip_image_header(FILE *fh, const unsigned char *magic) {
+    unsigned char flags[8];
+    long width, height;
+
+    if (memcmp(magic, bcflat_magic, 8) == 0)
+        return read_bcflat_header(fh, flags, &width, &height);
+    if (memcmp(magic, bcflat2_magic, 8) == 0)
+        return read_bcflat_header(fh, flags, &width, &height)
+            && read_u64_bigendian(fh) != -1;
+    if (memcmp(magic, bcseq_magic, 8) == 0)
+        return read_bcflat_header(fh, flags, &width, &height)
+            && read_u64_bigendian(fh) != -1
+            && read_u64_bigendian(fh) != -1;
+    /* BCRAW and BCPROG: the flags, width and height */
+    if (fseek(fh, 24, SEEK_CUR) != 0) {
+        format_problem = "short read of header";
+        return 0;
+    }
+    return 1;
+}
+
+/* Read only the thumbnail of the image file "fname", from its THMB
+   tag, reporting problems like parse_image. The other tags are
+   skipped over, and none of the image data is read. Returns a pointer
+   to the thumbnail as an image, or a null pointer on failure,
+   including when the file has no thumbnail. */
+struct image_info *parse_thumbnail(const char *fname) {
+    FILE *fh = fopen(fname, "rb");
+    unsigned char magic[8], ident[4];
+    struct image_info *info = 0;
+    int is_ok;
+
+    if (!fh) {
+        fprintf(stderr, "Failed to open %s: %s\n", fname, strerror(errno));
+        return 0;
+    }
+    if (fread(magic, 8, 1, fh) != 1) {
+        fprintf(stderr, "Failed to read magic number from %s\n", fname);
+        fclose(fh);
+        return 0;
+    }
+    if (memcmp(magic, bcraw_magic, 8) != 0
+        && memcmp(magic, bcprog_magic, 8) != 0
+        && memcmp(magic, bcflat_magic, 8) != 0
+        && memcmp(magic, bcflat2_magic, 8) != 0
+        && memcmp(magic, bcseq_magic, 8) != 0) {
+        fprintf(stderr, "%s: unrecognized format\n", fname);
+        fclose(fh);
+        return 0;
+    }
+
+    format_problem = 0;
+    is_ok = skip_image_header(fh, magic);
+    while (is_ok && !info) {
+        unsigned long size;
+        if (fread(ident, 4, 1, fh) != 1) {
+            format_problem = "short read of tag";
+            break;
+        }
+        if (!memcmp(ident, "DATA", 4)) {
+            format_problem = "no thumbnail";
+            break;
+        }
+        size = read_u64_bigendian(fh);
+        if (size == -1)
+            break;
+        if (size > (1LL << 40)) {
+            format_problem = "tag too large";
+            break;
+        }
+        if (!memcmp(ident, "THMB", 4)) {
+            info = read_thumbnail_tag(fh, size);
+            if (!info)
+                break;
+        } else if (fseek(fh, size, SEEK_CUR) != 0) {
+            format_problem = "short read of tag";
+            break;
+        }
+    }
+    fclose(fh);
+
+    if (!info) {
+        if (format_problem)
+            fprintf(stderr, "%s: invalid format, %s\n", fname, format_problem);
+        else
+            fprintf(stderr, "%s: invalid format\n", fname);
+    }
+    return info;
+}
+
+/* Shrink the pixels of "info" so that neither side is longer than
+   "max_size", keeping the aspect ratio. Each thumbnail pixel is the
+   average of the block of image pixels it covers. The size is stored
+   in *width_out and *height_out. If "packed" is set, the result uses
+   the BCPROG palette, one byte per pixel, and otherwise 3 bytes.
+   Returns a newly allocated buffer of pixels. */
+unsigned char *make_thumbnail(struct image_info *info, long max_size,
+                              int packed, long *width_out,
+                              long *height_out) {
+    long width = info->width, height = info->height;
+    long longest = width > height ? width : height;
+    long t_width = width, t_height = height, tx, ty;
+    unsigned char *thumb, *q;
+
+    if (longest > max_size) {
+        t_width = (width * max_size + longest / 2) / longest;
+        t_height = (height * max_size + longest / 2) / longest;
+    }
+    if (t_width < 1)
+        t_width = 1;
+    if (t_height < 1)
+        t_height = 1;
+    init_prog_levels();
+    thumb = xmalloc((packed ? 1 : 3) * t_width * t_height);
+    q = thumb;
+    for (ty = 0; ty < t_height; ty++) {
+        long y0 = ty * height / t_height, y1 = (ty + 1) * height / t_height;
+        for (tx = 0; tx < t_width; tx++) {
+            long x0 = tx * width / t_width, x1 = (tx + 1) * width / t_width;
+            long count = (x1 - x0) * (y1 - y0), sum[3] = {0, 0, 0}, x, y;
+            unsigned char avg[3];
+            int c;
+            for (y = y0; y < y1; y++) {
+                const unsigned char *p = info->pixels + 3 * (y * width + x0);
+                for (x = x0; x < x1; x++, p += 3) {
+                    sum[0] += p[0];
+                    sum[1] += p[1];
+                    sum[2] += p[2];
+                }
+            }
+            for (c = 0; c < 3; c++)
+                avg[c] = (sum[c] + count / 2) / count;
+            if (packed) {
+                *q++ = prog_levels[0][avg[0]] + prog_levels[1][avg[1]]
+                    + prog_levels[2][avg[2]];
+            } else {
+                memcpy(q, avg, 3);
+                q += 3;
+            }
+        }
+    }
+    *width_out = t_width;
+    *height_out = t_height;
+    return thumb;
+}
+
 void benign_target(void) {
     /* Currently doesn't do anything useful */
     static int benign_counter;
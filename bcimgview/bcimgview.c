@@ -36,10 +36,26 @@
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
+#include <unistd.h>
 
+/* Large BCFLAT images are decoded using several threads, so with C
+   libraries older than glibc 2.34 add -pthread to the compiler
+   command line. */
+#include <pthread.h>
 #include <sys/time.h>
 #include <sys/resource.h>
 
+/* PPM input files are read by mapping them into memory */
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/* The SSSE3 code is enabled per function and chosen at run time, so
+   it needs no special compiler options either. */
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#endif
+
 #ifndef DISABLE_GUI
 #include <gtk/gtk.h>
 #include <gdk-pixbuf/gdk-pixbuf.h>
@@ -53,10 +69,11 @@
 
 
 #ifndef DISABLE_GUI
-/* Display an image by converting it from image_info format into the
-   GDK Pixbuf structure, and associating that pixbuf with an image
-   widget in the GUI. */
-void display_image(struct image_info *info, GtkWidget *image) {
+/* Show the pixels of an image by converting them from image_info
+   format into the GDK Pixbuf structure, and associating that pixbuf
+   with an image widget in the GUI. The image_info is left as it
+   was. */
+void show_pixels(struct image_info *info, GtkWidget *image) {
     GdkPixbuf *pixbuf;
     long rowstride, y;
     guchar *pixels;
@@ -78,9 +95,16 @@ void display_image(struct image_info *info, GtkWidget *image) {
         memcpy(pixels + y * rowstride, info->pixels + y * rowsize, rowsize);
     }
 
-    /* This is the function that passes the pixbuf to GTK. */
+    /* This is the function that passes the pixbuf to GTK, which
+       keeps its own reference to it. */
     gtk_image_set_from_pixbuf(GTK_IMAGE(image), pixbuf);
+    g_object_unref(pixbuf);
+}
 
+/* Display an image in an image widget in the GUI, and then free
+   it. */
+void display_image(struct image_info *info, GtkWidget *image) {
+    show_pixels(info, image);
     print_log_msg(info);
 
     /* After copying to the pixbuf, the image_info isn't needed
@@ -115,7 +139,1028 @@ void write_ppm(struct image_info *info, const char *out_fname) {
     }
 }
 
+/* Read one number from a PPM header in memory, starting at *pp and
+   skipping the whitespace and comments before it, and leave *pp just
+   after the single whitespace character that ends it. Returns -1 if
+   there isn't one before "end". */
+long read_ppm_number(const unsigned char **pp, const unsigned char *end) {
+    const unsigned char *p = *pp;
+    long x = 0;
+    int digits = 0;
+    while (p < end) {
+        if (*p == '#') {
+            while (p < end && *p != '\n')
+                p++;
+        } else if (*p == ' ' || *p == '\t' || *p == '\n' || *p == '\r') {
+            p++;
+        } else {
+            break;
+        }
+    }
+    while (p < end && *p >= '0' && *p <= '9' && x < (1L << 30)) {
+        x = 10 * x + (*p++ - '0');
+        digits++;
+    }
+    /* The whitespace after the last number is part of the header, and
+       anything else is an error anyway */
+    if (!digits || p == end
+        || (*p != ' ' && *p != '\t' && *p != '\n' && *p != '\r'))
+        return -1;
+    *pp = p + 1;
+    return x;
+}
+
+/* Convert a PPM image in the binary ("P6") variant with 8-bit
+   samples, the same kind that write_ppm writes, from the "size" bytes
+   at "data" into our internal format. Returns a pointer to the new
+   image, or a null pointer after setting format_problem. */
+struct image_info *parse_ppm(const unsigned char *data, long size) {
+    const unsigned char *p = data + 2, *end = data + size;
+    struct image_info *info;
+    long width, height, maxval;
+
+    if (size < 2 || memcmp(data, "P6", 2) != 0) {
+        format_problem = "not a binary PPM image";
+        return 0;
+    }
+    width = read_ppm_number(&p, end);
+    height = read_ppm_number(&p, end);
+    maxval = read_ppm_number(&p, end);
+    if (width == -1 || height == -1 || maxval == -1) {
+        format_problem = "bad PPM header";
+        return 0;
+    } else if (maxval != 255) {
+        format_problem = "only 8-bit PPM images are supported";
+        return 0;
+    } else if (width < 1 || height < 1) {
+        format_problem = "size must be positive";
+        return 0;
+    } else if (width > size_limit || height > size_limit) {
+        format_problem = "size too large compared to stack";
+        return 0;
+    } else if (end - p < 3 * width * height) {
+        format_problem = "short read of PPM data";
+        return 0;
+    }
+    info = xmalloc(sizeof(struct image_info));
+    info->width = width;
+    info->height = height;
+    info->cleanup = 0;
+    info->create_time = -1;
+    info->pixels = xmalloc(3 * width * height);
+    memcpy(info->pixels, p, 3 * width * height);
+    return info;
+}
+
+/* Read a PPM image file (see parse_ppm). Rather than going through
+   stdio, the whole file is mapped into memory, so the pixels are
+   copied into place with a single memcpy. Returns a pointer to the
+   new image, or a null pointer after printing an error message. */
+struct image_info *read_ppm(const char *fname) {
+    struct image_info *info;
+    struct stat st;
+    void *map;
+    int fd = open(fname, O_RDONLY);
+
+    if (fd < 0) {
+        fprintf(stderr, "Failed to open %s: %s\n", fname, strerror(errno));
+        return 0;
+    }
+    if (fstat(fd, &st) != 0 || st.st_size == 0) {
+        fprintf(stderr, "%s: invalid format, empty file\n", fname);
+        close(fd);
+        return 0;
+    }
+    map = mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        fprintf(stderr, "Failed to map %s: %s\n", fname, strerror(errno));
+        return 0;
+    }
+    format_problem = 0;
+    info = parse_ppm(map, st.st_size);
+    munmap(map, st.st_size);
+    if (!info)
+        fprintf(stderr, "%s: invalid format, %s\n", fname, format_problem);
+    return info;
+}
+
+/* Write a number in the big-endian 64-bit format used for most
+   numeric metadata in Badly Coded image files. */
+void write_u64_bigendian(FILE *fh, uint64_t x) {
+    unsigned char bytes[8];
+    int i;
+    for (i = 7; i >= 0; i--) {
+        bytes[i] = x & 0xff;
+        x >>= 8;
+    }
+    fwrite(bytes, 8, 1, fh);
+}
+
+/* Read the tagged-data section of a Badly Coded image file, up to and
+   including the DATA tag, without interpreting it. The tags other
+   than "skip_ident" are collected, in the same format as in the file,
+   into a newly allocated buffer returned in *tags_out with its size
+   in *size_out. Returns 1 on success, or 0 after setting
+   format_problem. */
+int read_raw_tags(FILE *fh, const char *skip_ident,
+                  unsigned char **tags_out, long *size_out) {
+    unsigned char *tags = 0;
+    long tags_size = 0;
+    for (;;) {
+        unsigned char ident[4];
+        unsigned long size;
+        if (fread(ident, 4, 1, fh) != 1) {
+            format_problem = "short read of tag";
+            free(tags);
+            return 0;
+        }
+        if (!memcmp(ident, "DATA", 4))
+            break;
+        size = read_u64_bigendian(fh);
+        if (size == -1 || size > (1LL << 40)) {
+            if (size != -1)
+                format_problem = "tag too large";
+            free(tags);
+            return 0;
+        }
+        if (memcmp(ident, skip_ident, 4) != 0) {
+            long i;
+            tags = realloc(tags, tags_size + 12 + size);
+            if (!tags) {
+                fprintf(stderr, "Out of memory reading tags\n");
+                exit(1);
+            }
+            memcpy(tags + tags_size, ident, 4);
+            for (i = 0; i < 8; i++)
+                tags[tags_size + 4 + i] = size >> (56 - 8 * i);
+            if (fread(tags + tags_size + 12, 1, size, fh) != size) {
+                format_problem = "short read of tag";
+                free(tags);
+                return 0;
+            }
+            tags_size += 12 + size;
+        } else if (fseek(fh, size, SEEK_CUR) != 0) {
+            format_problem = "short read of tag";
+            free(tags);
+            return 0;
+        }
+    }
+    *tags_out = tags;
+    *size_out = tags_size;
+    return 1;
+}
+
+/* New image files are written under a temporary name and then
+   renamed, so an existing file is never left half-rewritten.
+   open_output opens the temporary file for "out_fname", storing its
+   newly allocated name in *tmp_fname_out. Returns the open file, or a
+   null pointer after printing an error message. */
+FILE *open_output(const char *out_fname, char **tmp_fname_out) {
+    char *tmp_fname = xmalloc(strlen(out_fname) + 5);
+    FILE *out;
+    strcpy(tmp_fname, out_fname);
+    strcat(tmp_fname, ".tmp");
+    out = fopen(tmp_fname, "wb");
+    if (!out) {
+        fprintf(stderr, "Failed to open %s for writing: %s\n",
+                tmp_fname, strerror(errno));
+        free(tmp_fname);
+        return 0;
+    }
+    *tmp_fname_out = tmp_fname;
+    return out;
+}
+
+/* Finish writing a file opened by open_output: close it and rename it
+   into place, or remove it if anything went wrong. Frees the
+   temporary name. Returns 1 on success, or 0 after printing an error
+   message. */
+int close_output(FILE *out, char *tmp_fname, const char *out_fname) {
+    int is_ok = !ferror(out);
+    if (fclose(out) != 0)
+        is_ok = 0;
+    if (is_ok && rename(tmp_fname, out_fname) != 0)
+        is_ok = 0;
+    if (!is_ok) {
+        fprintf(stderr, "Failed to write %s: %s\n", out_fname,
+                strerror(errno));
+        remove(tmp_fname);
+    }
+    free(tmp_fname);
+    return is_ok;
+}
+
+/* Write a BCFLAT image to "out" with the given header fields, tags
+   (in file format, "tags_size" bytes, not including DATA), and
+   "data_size" bytes of compressed data. If "row_start" is not null,
+   an RIDX tag is added from it. */
+void put_bcflat(FILE *out, unsigned char *flags, long width, long height,
+                unsigned char *tags, long tags_size, long *row_start,
+                unsigned char *data, long data_size) {
+    long r, num_rows = 3 * height;
+
+    fwrite(bcflat_magic, 8, 1, out);
+    fwrite(flags, 8, 1, out);
+    write_u64_bigendian(out, width);
+    write_u64_bigendian(out, height);
+    if (tags_size)
+        fwrite(tags, tags_size, 1, out);
+    if (row_start) {
+        fwrite("RIDX", 4, 1, out);
+        write_u64_bigendian(out, 8 * (num_rows + 1));
+        for (r = 0; r <= num_rows; r++)
+            write_u64_bigendian(out, row_start[r]);
+    }
+    fwrite("DATA", 4, 1, out);
+    if (data_size)
+        fwrite(data, data_size, 1, out);
+}
+
+/* Write a BCFLAT image file "out_fname", as put_bcflat does. Returns
+   1 on success, or 0 after printing an error message. */
+int write_bcflat_file(const char *out_fname, unsigned char *flags,
+                      long width, long height, unsigned char *tags,
+                      long tags_size, long *row_start, unsigned char *data,
+                      long data_size) {
+    char *tmp_fname;
+    FILE *out = open_output(out_fname, &tmp_fname);
+
+    if (!out)
+        return 0;
+    put_bcflat(out, flags, width, height, tags, tags_size, row_start,
+               data, data_size);
+    return close_output(out, tmp_fname, out_fname);
+}
+
+/* Add an RIDX tag, holding the offset of every compressed row, to the
+   BCFLAT image "in_fname", replacing any index it already had. The
+   result is written to "out_fname", which may be the same file.
+   Returns the exit status for the program. */
+int index_bcflat(const char *in_fname, const char *out_fname) {
+    FILE *in;
+    unsigned char magic[8], flags[8], *tags, *data;
+    long width, height, tags_size, data_size;
+    long *row_start;
+    int is_ok;
+
+    in = fopen(in_fname, "rb");
+    if (!in) {
+        fprintf(stderr, "Failed to open %s: %s\n", in_fname, strerror(errno));
+        return 1;
+    }
+    format_problem = 0;
+    if (fread(magic, 8, 1, in) != 1 || memcmp(magic, bcflat_magic, 8) != 0) {
+        fprintf(stderr, "%s: not a BCFLAT image\n", in_fname);
+        fclose(in);
+        return 1;
+    }
+    is_ok = read_bcflat_header(in, flags, &width, &height);
+    if (is_ok && flat_variant(flags)) {
+        /* A row index could be added, but nothing would use it */
+        format_problem = "can't index the codec variant";
+        is_ok = 0;
+    }
+    is_ok = is_ok && read_raw_tags(in, "RIDX", &tags, &tags_size);
+    if (!is_ok) {
+        fprintf(stderr, "%s: invalid format, %s\n", in_fname,
+                format_problem ? format_problem : "bad header");
+        fclose(in);
+        return 1;
+    }
+    data = read_flat_all(in, 0, &data_size);
+    fclose(in);
+    init_flat_codes();
+    row_start = data ? scan_flat_rows(data, data_size, width, height) : 0;
+    if (!row_start) {
+        fprintf(stderr, "%s: invalid format, %s\n", in_fname, format_problem);
+        free(tags);
+        free(data);
+        return 1;
+    }
+
+    is_ok = write_bcflat_file(out_fname, flags, width, height, tags,
+                              tags_size, row_start, data, data_size);
+    if (is_ok)
+        printf("Indexed %ld rows of %s into %s\n", 3 * height, in_fname,
+               out_fname);
+    free(row_start);
+    free(tags);
+    free(data);
+    return !is_ok;
+}
+
+/* Read an image to be encoded, which can be a binary PPM file, or an
+   image in any format we can read. Returns a pointer to the image, or
+   a null pointer after printing an error message. */
+struct image_info *read_input_image(const char *fname) {
+    char magic[2];
+    int is_ppm;
+    FILE *in = fopen(fname, "rb");
+
+    if (!in) {
+        fprintf(stderr, "Failed to open %s: %s\n", fname, strerror(errno));
+        return 0;
+    }
+    is_ppm = fread(magic, 2, 1, in) == 1 && !memcmp(magic, "P6", 2);
+    fclose(in);
+    return is_ppm ? read_ppm(fname) : parse_image(fname);
+}
+
+/* Largest side of the thumbnail added to encoded images, set with
+   -T, or 0 for no thumbnail. With thumbnail_packed set, it uses the
+   BCPROG palette rather than full RGB. */
+long thumbnail_size = 0;
+int thumbnail_packed = 0;
+
+/* Whether to add a DCRC checksum of the image data to encoded images,
+   set with -k. */
+int write_data_crc = 0;
+
+/* Build the tags for a newly encoded image "info": TIME, if the
+   creation time is known, DCRC with "crc" if write_data_crc is set,
+   and a THMB thumbnail if thumbnail_size is set. Returns them in file
+   format in a newly allocated buffer, with their size in
+   *size_out. */
+unsigned char *make_tags(struct image_info *info, uint32_t crc,
+                         long *size_out) {
+    unsigned char *tags, *thumb = 0;
+    long t_width = 0, t_height = 0, thumb_bytes = 0, size = 0;
+
+    if (thumbnail_size && info->width && info->height) {
+        thumb = make_thumbnail(info, thumbnail_size, thumbnail_packed,
+                               &t_width, &t_height);
+        thumb_bytes = (thumbnail_packed ? 1 : 3) * t_width * t_height;
+    }
+    tags = xmalloc(20 + 20 + 36 + thumb_bytes);
+    if (info->create_time != -1) {
+        memcpy(tags, "TIME", 4);
+        store_u64_bigendian(tags + 4, 8);
+        store_u64_bigendian(tags + 12, info->create_time);
+        size = 20;
+    }
+    if (write_data_crc) {
+        memcpy(tags + size, "DCRC", 4);
+        store_u64_bigendian(tags + size + 4, 8);
+        store_u64_bigendian(tags + size + 12, crc);
+        size += 20;
+    }
+    if (thumb) {
+        memcpy(tags + size, "THMB", 4);
+        store_u64_bigendian(tags + size + 4, 24 + thumb_bytes);
+        store_u64_bigendian(tags + size + 12, t_width);
+        store_u64_bigendian(tags + size + 20, t_height);
+        store_u64_bigendian(tags + size + 28, thumbnail_packed ? 0xd8 : 8);
+        memcpy(tags + size + 36, thumb, thumb_bytes);
+        size += 36 + thumb_bytes;
+        free(thumb);
+    }
+    *size_out = size;
+    return tags;
+}
+
+/* Parse the argument of -T, "<size>" or "<size>,packed", into
+   thumbnail_size and thumbnail_packed. Returns 1 on success, or 0
+   after printing an error message. */
+int parse_thumbnail_option(const char *arg) {
+    char *end;
+    thumbnail_size = strtol(arg, &end, 10);
+    thumbnail_packed = !strcmp(end, ",packed");
+    if (end == arg || (*end && !thumbnail_packed) || thumbnail_size < 1
+        || thumbnail_size > THMB_MAX_SIZE) {
+        fprintf(stderr, "Thumbnail size should be 1 to %d, optionally"
+                " followed by \",packed\"\n", THMB_MAX_SIZE);
+        return 0;
+    }
+    return 1;
+}
+
+/* Codec variant for BCFLAT images written by -e, set with -m (see
+   flat_variant). The defaults give plain BCFLAT. Images in a variant
+   can't be given a row index, or be read one row at a time by -s or
+   from standard input. */
+int encode_predictor = FLAT_PREDICT_LEFT, encode_long_runs = 0;
+
+/* Parse a codec variant given to -m as a comma-separated list of the
+   words "left", "up", "average" (the predictor) and "runs" (long run
+   codewords) into *predictor and *long_runs. Returns 1 on success, or
+   0 after printing an error message. */
+int parse_flat_codec(const char *spec, int *predictor, int *long_runs) {
+    static const char *const predictors[3] = {"left", "up", "average"};
+    const char *p = spec;
+    *predictor = FLAT_PREDICT_LEFT;
+    *long_runs = 0;
+    while (*p) {
+        size_t len = strcspn(p, ",");
+        int i;
+        for (i = 0; i < 3; i++) {
+            if (len == strlen(predictors[i])
+                && !strncmp(p, predictors[i], len))
+                break;
+        }
+        if (i < 3) {
+            *predictor = i;
+        } else if (len == 4 && !strncmp(p, "runs", 4)) {
+            *long_runs = 1;
+        } else {
+            fprintf(stderr, "Unknown codec option \"%.*s\" in %s\n",
+                    (int)len, p, spec);
+            return 0;
+        }
+        p += len;
+        if (*p == ',')
+            p++;
+    }
+    return 1;
+}
+
+/* Write "info" as a BCFLAT image "out_fname", with an RIDX tag if
+   "with_index" is set, and in the codec variant given by "predictor"
+   and "long_runs" (see encode_flat_rows). Returns 1 on success, or 0
+   after printing an error message. */
+int write_bcflat(struct image_info *info, const char *out_fname,
+                 int with_index, int predictor, int long_runs) {
+    unsigned char flags[8] = {0, 0, 0, 0, 0, 0, 0x0d, 0x03};
+    unsigned char *tags, *data;
+    long *row_start = encode_flat_rows(info, predictor, long_runs, &data);
+    long tags_size;
+    uint32_t crc = 0;
+    int is_ok;
+
+    flags[4] = long_runs;
+    flags[5] = predictor;
+    if (write_data_crc)
+        crc = crc32c(0, data, row_start[3 * info->height]);
+    tags = make_tags(info, crc, &tags_size);
+    is_ok = write_bcflat_file(out_fname, flags, info->width, info->height,
+                              tags, tags_size,
+                              with_index ? row_start : 0, data,
+                              row_start[3 * info->height]);
+    free(tags);
+    free(row_start);
+    free(data);
+    return is_ok;
+}
+
+/* Write "info" as a BCFLAT2 image "out_fname", in stripes of
+   FLAT2_STRIPE_ROWS rows. Returns 1 on success, or 0 after printing an
+   error message. */
+int write_bcflat2(struct image_info *info, const char *out_fname) {
+    unsigned char flags[8] = {0, 0, 0, 0, 0, 0, 0x0d, 0x03};
+    unsigned char *tags, *data;
+    long *row_start = encode_flat_rows(info, 0, 0, &data);
+    long tags_size, height = info->height, y_start, y_end;
+    char *tmp_fname;
+    FILE *out = open_output(out_fname, &tmp_fname);
+    uint32_t crc = 0;
+    int c;
+
+    if (!out) {
+        free(row_start);
+        free(data);
+        return 0;
+    }
+    /* The checksum covers each stripe's length and its rows */
+    for (y_start = 0; y_start < height && write_data_crc; y_start = y_end) {
+        unsigned char size_bytes[8];
+        long size = 0;
+        y_end = MIN(y_start + FLAT2_STRIPE_ROWS, height);
+        for (c = 0; c < 3; c++)
+            size += row_start[c * height + y_end]
+                - row_start[c * height + y_start];
+        store_u64_bigendian(size_bytes, size);
+        crc = crc32c(crc, size_bytes, 8);
+        for (c = 0; c < 3; c++)
+            crc = crc32c(crc, data + row_start[c * height + y_start],
+                         row_start[c * height + y_end]
+                         - row_start[c * height + y_start]);
+    }
+    tags = make_tags(info, crc, &tags_size);
+    fwrite(bcflat2_magic, 8, 1, out);
+    fwrite(flags, 8, 1, out);
+    write_u64_bigendian(out, info->width);
+    write_u64_bigendian(out, height);
+    write_u64_bigendian(out, FLAT2_STRIPE_ROWS);
+    if (tags_size)
+        fwrite(tags, tags_size, 1, out);
+    free(tags);
+    fwrite("DATA", 4, 1, out);
+    /* The rows of each channel are consecutive in the encoded data,
+       so each stripe is three pieces of it */
+    for (y_start = 0; y_start < height; y_start = y_end) {
+        long size = 0;
+        y_end = MIN(y_start + FLAT2_STRIPE_ROWS, height);
+        for (c = 0; c < 3; c++)
+            size += row_start[c * height + y_end]
+                - row_start[c * height + y_start];
+        write_u64_bigendian(out, size);
+        for (c = 0; c < 3; c++)
+            fwrite(data + row_start[c * height + y_start],
+                   row_start[c * height + y_end]
+                   - row_start[c * height + y_start], 1, out);
+    }
+    free(row_start);
+    free(data);
+    return close_output(out, tmp_fname, out_fname);
+}
+
+/* Write "info" as a BCPROG image "out_fname", with error diffusion if
+   "dither" is set. The rows are written in the three passes that
+   read_prog_data reads them in: every fourth row starting with 0,
+   then every fourth row starting with 2, then all the odd rows. The
+   second pass always has at least one row, so the image must be at
+   least 3 rows tall. Returns 1 on success, or 0 after printing an
+   error message. */
+int write_bcprog(struct image_info *info, const char *out_fname,
+                 int dither) {
+    unsigned char flags[8] = {0, 0, 0, 0, 0, 0, 0x01, 0xd8};
+    unsigned char *tags, *packed;
+    long tags_size, width = info->width, height = info->height, row;
+    uint32_t crc = 0;
+    int pass;
+    static const int pass_start[3] = {0, 2, 1}, pass_step[3] = {4, 4, 2};
+    char *tmp_fname;
+    FILE *out;
+
+    if (height < 3 || height > 600 || width > 800) {
+        fprintf(stderr, "BCPROG images must be 1x3 to 800x600 pixels,"
+                " not %ldx%ld\n", width, height);
+        return 0;
+    }
+    out = open_output(out_fname, &tmp_fname);
+    if (!out)
+        return 0;
+    packed = quantize_prog(info, dither);
+    for (pass = 0; pass < 3 && write_data_crc; pass++) {
+        for (row = pass_start[pass]; row < height; row += pass_step[pass])
+            crc = crc32c(crc, packed + row * width, width);
+    }
+    tags = make_tags(info, crc, &tags_size);
+    fwrite(bcprog_magic, 8, 1, out);
+    fwrite(flags, 8, 1, out);
+    write_u64_bigendian(out, width);
+    write_u64_bigendian(out, height);
+    if (tags_size)
+        fwrite(tags, tags_size, 1, out);
+    free(tags);
+    fwrite("DATA", 4, 1, out);
+    for (pass = 0; pass < 3; pass++) {
+        for (row = pass_start[pass]; row < height; row += pass_step[pass])
+            fwrite(packed + row * width, width, 1, out);
+    }
+    free(packed);
+    return close_output(out, tmp_fname, out_fname);
+}
+
+/* Write "info" as a BCRAW image "out_fname". The pixels are already
+   in the BCRAW layout, so they are written with a single fwrite.
+   Returns 1 on success, or 0 after printing an error message. */
+int write_bcraw(struct image_info *info, const char *out_fname) {
+    unsigned char flags[8] = {0, 0, 0, 0, 0, 0, 0, 8};
+    unsigned char *tags;
+    long tags_size;
+    uint32_t crc = 0;
+    char *tmp_fname;
+    FILE *out = open_output(out_fname, &tmp_fname);
+
+    if (!out)
+        return 0;
+    if (write_data_crc)
+        crc = crc32c(0, info->pixels, 3 * info->width * info->height);
+    tags = make_tags(info, crc, &tags_size);
+    fwrite(bcraw_magic, 8, 1, out);
+    fwrite(flags, 8, 1, out);
+    write_u64_bigendian(out, info->width);
+    write_u64_bigendian(out, info->height);
+    if (tags_size)
+        fwrite(tags, tags_size, 1, out);
+    free(tags);
+    fwrite("DATA", 4, 1, out);
+    fwrite(info->pixels, 3 * info->width, info->height, out);
+    return close_output(out, tmp_fname, out_fname);
+}
+
+/* Frames per second of sequences written by -e, and of playback in
+   the GUI if set, from -f. 0 means SEQ_DEFAULT_RATE when writing, and
+   the sequence's own rate when playing. */
+double frame_rate = 0;
+#define SEQ_DEFAULT_RATE 25
+
+/* Every this many frames a sequence gets a key frame, so that
+   starting to play it partway through never means decoding more than
+   this many frames. */
+#define SEQ_KEY_INTERVAL 250
+
+/* Write the images "fnames" (see read_input_image), which must all be
+   the same size, as the frames of a BCSEQ sequence "out_fname". Only
+   three frames' worth of pixels are in memory at once: the previous
+   frame, the current one, and the difference between them. The
+   checksum for -k isn't known until every frame has been written, so
+   the DCRC tag is written with 0 and filled in at the end. Returns 1
+   on success, or 0 after printing an error message. */
+int write_bcseq(int num_frames, char **fnames, const char *out_fname) {
+    unsigned char flags[8] = {0, 0, 0, 0, 1, FLAT_PREDICT_LEFT,
+                              0x0d, 0x03};
+    struct image_info *prev = 0, *cur = 0, diff;
+    long i, n, num_bytes = 0, crc_pos = 0;
+    uint32_t crc = 0;
+    char *tmp_fname;
+    FILE *out;
+
+    out = open_output(out_fname, &tmp_fname);
+    if (!out)
+        return 0;
+    diff.pixels = 0;
+    for (i = 0; i < num_frames; i++) {
+        unsigned char *data, header[SEQ_FRAME_HEADER];
+        long *row_start;
+        int kind = i % SEQ_KEY_INTERVAL ? SEQ_DELTA_FRAME : SEQ_KEY_FRAME;
+        cur = read_input_image(fnames[i]);
+        if (!cur)
+            break;
+        if (!prev) {
+            unsigned char *tags;
+            long tags_size;
+            tags = make_tags(cur, 0, &tags_size);
+            fwrite(bcseq_magic, 8, 1, out);
+            fwrite(flags, 8, 1, out);
+            write_u64_bigendian(out, cur->width);
+            write_u64_bigendian(out, cur->height);
+            write_u64_bigendian(out, num_frames);
+            write_u64_bigendian(out, 1e6 / (frame_rate ? frame_rate
+                                                       : SEQ_DEFAULT_RATE));
+            /* make_tags puts DCRC straight after any TIME tag */
+            crc_pos = ftell(out) + (cur->create_time != -1 ? 20 : 0) + 12;
+            if (tags_size)
+                fwrite(tags, tags_size, 1, out);
+            free(tags);
+            fwrite("DATA", 4, 1, out);
+            num_bytes = 3 * cur->width * cur->height;
+            diff = *cur;
+            diff.pixels = xmalloc(num_bytes);
+        } else if (cur->width != prev->width
+                   || cur->height != prev->height) {
+            fprintf(stderr, "%s is %ldx%ld, but the first frame is"
+                    " %ldx%ld\n", fnames[i], cur->width, cur->height,
+                    prev->width, prev->height);
+            break;
+        }
+        if (kind == SEQ_DELTA_FRAME) {
+            for (n = 0; n < num_bytes; n++)
+                diff.pixels[n] = cur->pixels[n] - prev->pixels[n];
+        }
+        row_start = encode_flat_rows(kind == SEQ_KEY_FRAME ? cur : &diff,
+                                     FLAT_PREDICT_LEFT, 1, &data);
+        header[0] = kind;
+        store_u64_bigendian(header + 1, row_start[3 * cur->height]);
+        fwrite(header, SEQ_FRAME_HEADER, 1, out);
+        fwrite(data, row_start[3 * cur->height], 1, out);
+        if (write_data_crc) {
+            crc = crc32c(crc, header, SEQ_FRAME_HEADER);
+            crc = crc32c(crc, data, row_start[3 * cur->height]);
+        }
+        free(row_start);
+        free(data);
+        if (prev)
+            free_image_info(prev);
+        prev = cur;
+        cur = 0;
+    }
+    free(diff.pixels);
+    if (prev)
+        free_image_info(prev);
+    if (i < num_frames) {
+        if (cur)
+            free_image_info(cur);
+        fclose(out);
+        remove(tmp_fname);
+        free(tmp_fname);
+        return 0;
+    }
+    if (write_data_crc) {
+        fseek(out, crc_pos, SEEK_SET);
+        write_u64_bigendian(out, crc);
+    }
+    return close_output(out, tmp_fname, out_fname);
+}
+
+/* Check whether "fname" ends with "suffix". */
+int has_suffix(const char *fname, const char *suffix) {
+    size_t len = strlen(fname), suffix_len = strlen(suffix);
+    return len >= suffix_len && !strcmp(fname + len - suffix_len, suffix);
+}
+
+/* Encode the image "in_fname" (see read_input_image) as "out_fname",
+   in the format its name ends with: BCPROG for ".bcprog", BCRAW for
+   ".bcraw", BCFLAT2 for ".bcflat2", and BCFLAT otherwise.
+   "with_index" adds an RIDX tag to a BCFLAT image, and "dither" turns
+   on error diffusion for BCPROG. The codec variant from -m is only
+   for BCFLAT. Returns the exit status for the program. */
+int encode_image(const char *in_fname, const char *out_fname,
+                 int with_index, int dither) {
+    int is_bcflat = !has_suffix(out_fname, ".bcprog")
+        && !has_suffix(out_fname, ".bcraw")
+        && !has_suffix(out_fname, ".bcflat2");
+    struct image_info *info;
+    int is_ok;
+    if (!is_bcflat && (encode_predictor || encode_long_runs)) {
+        fprintf(stderr, "Codec variants are only for BCFLAT output\n");
+        return 1;
+    }
+    info = read_input_image(in_fname);
+    if (!info)
+        return 1;
+    if (has_suffix(out_fname, ".bcprog"))
+        is_ok = write_bcprog(info, out_fname, dither);
+    else if (has_suffix(out_fname, ".bcraw"))
+        is_ok = write_bcraw(info, out_fname);
+    else if (has_suffix(out_fname, ".bcflat2"))
+        is_ok = write_bcflat2(info, out_fname);
+    else
+        is_ok = write_bcflat(info, out_fname, with_index, encode_predictor,
+                             encode_long_runs);
+    if (is_ok)
+        printf("Encoded %s into %s\n", in_fname, out_fname);
+    free_image_info(info);
+    return !is_ok;
+}
+
+/* Encode the images "fnames" (see read_input_image) as the frames of
+   the BCSEQ sequence "out_fname". Returns the exit status for the
+   program. */
+int encode_sequence(int num_frames, char **fnames, const char *out_fname) {
+    if (encode_predictor || encode_long_runs) {
+        fprintf(stderr, "Codec variants are only for BCFLAT output\n");
+        return 1;
+    }
+    if (!write_bcseq(num_frames, fnames, out_fname))
+        return 1;
+    printf("Encoded %d frames into %s\n", num_frames, out_fname);
+    return 0;
+}
+
+/* Codec variants compared by compare_codecs, plain BCFLAT first. */
+struct flat_codec {
+    const char *name;
+    int predictor, long_runs;
+};
+static const struct flat_codec flat_codecs[] = {
+    {"left", FLAT_PREDICT_LEFT, 0},
+    {"up", FLAT_PREDICT_UP, 0},
+    {"average", FLAT_PREDICT_AVERAGE, 0},
+    {"left,runs", FLAT_PREDICT_LEFT, 1},
+    {"up,runs", FLAT_PREDICT_UP, 1},
+    {"average,runs", FLAT_PREDICT_AVERAGE, 1},
+};
+#define NUM_FLAT_CODECS (sizeof(flat_codecs) / sizeof(flat_codecs[0]))
+
+/* Times each image is decoded in compare_codecs; the fastest counts. */
+#define COMPARE_DECODES 3
+
+/* Encode "info" as a BCFLAT image in the codec variant "codec" into a
+   temporary file, check that it decodes back to the same pixels, and
+   store its size in *size_out and its fastest decoding time in
+   seconds in *secs_out. Returns 1 on success, or 0 after printing an
+   error message. */
+int measure_codec(struct image_info *info, const struct flat_codec *codec,
+                  long *size_out, double *secs_out) {
+    unsigned char flags[8] = {0, 0, 0, 0, 0, 0, 0x0d, 0x03}, magic[8];
+    unsigned char *data;
+    long *row_start;
+    FILE *fh = tmpfile();
+    int i, is_ok = 1;
+
+    if (!fh) {
+        fprintf(stderr, "Failed to create a temporary file: %s\n",
+                strerror(errno));
+        return 0;
+    }
+    row_start = encode_flat_rows(info, codec->predictor, codec->long_runs,
+                                 &data);
+    flags[4] = codec->long_runs;
+    flags[5] = codec->predictor;
+    put_bcflat(fh, flags, info->width, info->height, 0, 0, 0, data,
+               row_start[3 * info->height]);
+    free(row_start);
+    free(data);
+    *size_out = ftell(fh);
+    *secs_out = 0;
+    for (i = 0; i < COMPARE_DECODES && is_ok; i++) {
+        struct image_info *decoded;
+        struct timeval start, end;
+        double secs;
+        rewind(fh);
+        format_problem = 0;
+        gettimeofday(&start, 0);
+        decoded = fread(magic, 8, 1, fh) == 1 ? parse_bcflat(fh) : 0;
+        gettimeofday(&end, 0);
+        secs = (end.tv_sec - start.tv_sec) + 1e-6 * (end.tv_usec
+                                                     - start.tv_usec);
+        if (i == 0 || secs < *secs_out)
+            *secs_out = secs;
+        if (!decoded || memcmp(decoded->pixels, info->pixels,
+                               3 * info->width * info->height) != 0) {
+            fprintf(stderr, "%s codec failed to round trip: %s\n",
+                    codec->name, format_problem ? format_problem
+                    : "different pixels");
+            is_ok = 0;
+        }
+        if (decoded)
+            free_image_info(decoded);
+    }
+    fclose(fh);
+    return is_ok;
+}
+
+/* Report mode: encode each image (see read_input_image) with every
+   codec variant, and print how large the result is, compared to the
+   uncompressed pixels, and how long it takes to decode, followed by
+   the totals over all the images. The variants trade decoding speed
+   for size: they are decoded one codeword at a time rather than with
+   the plain BCFLAT decoder, and the average predictor one sample at
+   a time, which the report notes. Returns the exit status for the
+   program. */
+int compare_codecs(int num_files, char **fnames) {
+    long total_size[NUM_FLAT_CODECS] = {0}, total_raw = 0;
+    double total_secs[NUM_FLAT_CODECS] = {0};
+    int i, k, status = 0;
+
+    printf("%-24s %-13s %10s %7s %9s\n", "image", "codec", "bytes",
+           "ratio", "decode");
+    for (i = 0; i < num_files; i++) {
+        struct image_info *info = read_input_image(fnames[i]);
+        long raw;
+        if (!info) {
+            status = 1;
+            continue;
+        }
+        raw = 3 * info->width * info->height;
+        total_raw += raw;
+        for (k = 0; k < NUM_FLAT_CODECS; k++) {
+            long size;
+            double secs;
+            if (!measure_codec(info, &flat_codecs[k], &size, &secs)) {
+                status = 1;
+                continue;
+            }
+            total_size[k] += size;
+            total_secs[k] += secs;
+            printf("%-24s %-13s %10ld %6.1f%% %6.2f ms\n", fnames[i],
+                   flat_codecs[k].name, size, 100.0 * size / (raw ? raw : 1),
+                   1e3 * secs);
+        }
+        free_image_info(info);
+    }
+    for (k = 0; k < NUM_FLAT_CODECS; k++)
+        printf("%-24s %-13s %10ld %6.1f%% %6.2f ms\n", "total",
+               flat_codecs[k].name, total_size[k],
+               100.0 * total_size[k] / (total_raw ? total_raw : 1),
+               1e3 * total_secs[k]);
+    printf("Every variant but plain \"left\" decodes one codeword at a"
+           " time, and \"average\"\none sample at a time, so they are"
+           " slower than plain BCFLAT.\n");
+    return status;
+}
+
 #ifndef DISABLE_GUI
+/* Most frames decoded at once when playback falls behind. After that
+   many, the schedule starts over from the current frame, so a
+   sequence that decodes slower than real time still plays, just
+   slowly. */
+#define PLAYBACK_MAX_SKIP 10
+
+/* A BCSEQ sequence being played in the GUI. Frame n is due "n"
+   periods after playback started, and each frame is shown by a timer
+   set for when it is due, so time spent decoding doesn't add up into
+   a slower frame rate. Frames whose time has already passed are
+   decoded, to keep the image up to date, but not shown. At the end,
+   the sequence starts again. */
+struct seq_playback {
+    gchar *fname;
+    FILE *fh;
+    struct seq_reader *seq;
+    GtkWidget *image;
+    gint64 start;       /* monotonic time when frame 0 was due, in us */
+    long period;        /* microseconds between frames */
+    long frame;         /* number of frames decoded since start */
+    guint timer;        /* GLib source of the pending timeout, or 0 */
+};
+
+/* The sequence currently playing, if any. */
+struct seq_playback *playback = 0;
+
+/* Report the problem in format_problem with the sequence "fname". */
+void report_seq_problem(const char *fname) {
+    if (format_problem)
+        fprintf(stderr, "%s: invalid format, %s\n", fname, format_problem);
+    else
+        fprintf(stderr, "%s: invalid format\n", fname);
+}
+
+/* Stop playing the current sequence, if any, and free it. The last
+   frame shown stays in the image widget. */
+void stop_playback(void) {
+    if (!playback)
+        return;
+    if (playback->timer)
+        g_source_remove(playback->timer);
+    close_seq(playback->seq);
+    fclose(playback->fh);
+    g_free(playback->fname);
+    free(playback);
+    playback = 0;
+}
+
+/* Timer callback to show the next frame that is due, and set the timer
+   again for the one after that. */
+static gboolean on_seq_frame(gpointer user_data) {
+    struct seq_playback *play = user_data;
+    gint64 now = g_get_monotonic_time(), due;
+    int num_decoded = 0;
+
+    play->timer = 0;
+    do {
+        if (play->seq->frame == play->seq->num_frames
+            && !rewind_seq(play->seq)) {
+            report_seq_problem(play->fname);
+            stop_playback();
+            return FALSE;
+        }
+        if (!read_seq_frame(play->seq)) {
+            report_seq_problem(play->fname);
+            stop_playback();
+            return FALSE;
+        }
+        play->frame++;
+        num_decoded++;
+        due = play->start + play->frame * play->period;
+    } while (due <= now && num_decoded < PLAYBACK_MAX_SKIP);
+    if (due <= now) {
+        play->start = now - (play->frame - 1) * play->period;
+        due = now + play->period;
+    }
+    show_pixels(play->seq->info, play->image);
+
+    now = g_get_monotonic_time();
+    play->timer = g_timeout_add(due > now ? (due - now) / 1000 : 0,
+                                on_seq_frame, play);
+    return FALSE;
+}
+
+/* Start playing the BCSEQ sequence "fname" in "image", at frame_rate
+   frames per second if set, or otherwise the sequence's own rate. */
+void start_playback(const char *fname, GtkWidget *image) {
+    unsigned char magic[8];
+    struct seq_reader *seq;
+    FILE *fh = fopen(fname, "rb");
+
+    if (!fh) {
+        fprintf(stderr, "Failed to open %s: %s\n", fname, strerror(errno));
+        return;
+    }
+    if (fread(magic, 8, 1, fh) != 1 || memcmp(magic, bcseq_magic, 8) != 0) {
+        fprintf(stderr, "%s: unrecognized format\n", fname);
+        fclose(fh);
+        return;
+    }
+    format_problem = 0;
+    seq = open_seq(fh, 0);
+    if (!seq || !read_seq_frame(seq)) {
+        report_seq_problem(fname);
+        if (seq)
+            close_seq(seq);
+        fclose(fh);
+        return;
+    }
+    playback = xmalloc(sizeof(struct seq_playback));
+    playback->fname = g_strdup(fname);
+    playback->fh = fh;
+    playback->seq = seq;
+    playback->image = image;
+    playback->period = frame_rate ? 1e6 / frame_rate : seq->period;
+    playback->start = g_get_monotonic_time();
+    playback->frame = 1;
+    show_pixels(seq->info, image);
+    print_log_msg(seq->info);
+    (*per_image_callback)();
+    playback->timer = g_timeout_add(playback->period / 1000, on_seq_frame,
+                                    playback);
+}
+
+/* Show the image "fname" in "image", or if it is a BCSEQ sequence,
+   start playing it there, stopping any sequence already playing. */
+void open_image(const char *fname, GtkWidget *image) {
+    struct image_info *info;
+    stop_playback();
+    if (has_suffix(fname, ".bcseq")) {
+        start_playback(fname, image);
+        return;
+    }
+    info = parse_image(fname);
+    if (info)
+        display_image(info, image);
+}
+
 /* Use a GTK file chooser to let a user graphically select another
    image to display. */
 static void on_open_image(GtkButton* button, gpointer user_data) {
@@ -135,6 +1180,7 @@ static void on_open_image(GtkButton* button, gpointer user_data) {
     gtk_file_filter_add_pattern(filter, "*.bcraw");
     gtk_file_filter_add_pattern(filter, "*.bcprog");
     gtk_file_filter_add_pattern(filter, "*.bcflat");
+    gtk_file_filter_add_pattern(filter, "*.bcseq");
     gtk_file_filter_set_name(filter, "Badly-coded format images");
     gtk_file_chooser_add_filter(GTK_FILE_CHOOSER (dialog),
                                 filter);
@@ -144,9 +1190,7 @@ static void on_open_image(GtkButton* button, gpointer user_data) {
         {
             gchar *filename = 
                 gtk_file_chooser_get_filename(GTK_FILE_CHOOSER(dialog));
-            struct image_info *info = parse_image(filename);
-            if (info)
-                display_image(info, image);
+            open_image(filename, image);
             break;
         }
     default:
@@ -198,8 +1242,367 @@ static GtkWidget* create_window(void) {
 }
 #endif
 
+/* Print a summary of the command-line options. */
+void usage(void) {
+#ifdef DISABLE_GUI
+    fprintf(stderr, "Usage: bcimgview-nogui [-j <threads>] [-p] -c <image>\n");
+#else
+    fprintf(stderr, "Usage: bcimgview [-j <threads>] [-p] [-f <fps>] [-c] [<image>]\n");
+#endif
+    fprintf(stderr, "       bcimgview -c -r <first row>,<rows> <image>\n");
+    fprintf(stderr, "       bcimgview -c - < <plain bcflat image>\n");
+    fprintf(stderr, "       bcimgview [-j <threads>] [-i] [-k] [-d] [-m <codec>] [-T <size>[,packed]] -e <image> [<output>]\n");
+    fprintf(stderr, "         (-m variants are smaller but slower to decode; compare them with -C.\n");
+    fprintf(stderr, "          They can't be indexed with -i, streamed with -s, or read with -c -)\n");
+    fprintf(stderr, "       bcimgview [-j <threads>] [-k] [-f <fps>] [-T <size>[,packed]] -e <frame>... <output>.bcseq\n");
+    fprintf(stderr, "       bcimgview -t <image> [<output>]\n");
+    fprintf(stderr, "       bcimgview -C <image>...\n");
+    fprintf(stderr, "       bcimgview -P <pack> <image>...\n");
+    fprintf(stderr, "       bcimgview -l <pack>\n");
+    fprintf(stderr, "       bcimgview -x <pack> <image>...\n");
+    fprintf(stderr, "       bcimgview -i <plain bcflat image> [<output>]\n");
+    fprintf(stderr, "       bcimgview -s <plain bcflat image> [<output>]\n");
+    fprintf(stderr, "       bcimgview [-j <threads>] -v <image>...\n");
+}
+
+/* Validation mode: check that each image is well-formed, without
+   converting it. Returns the exit status for the program. */
+int validate_images(int num_files, char **fnames) {
+    int i, status = 0;
+    for (i = 0; i < num_files; i++) {
+        if (validate_image(fnames[i]))
+            printf("%s: OK\n", fnames[i]);
+        else
+            status = 1;
+    }
+    return status;
+}
+
+/* Streaming conversion mode: convert a BCFLAT image into a PPM file
+   one row at a time, so that the whole image never has to be in
+   memory. Returns the exit status for the program. */
+int stream_convert(const char *in_fname, const char *out_fname) {
+    struct flat_row_stream *stream = open_flat_rows(in_fname);
+    FILE *out;
+    long y;
+    int is_ok = 1;
+    if (!stream) {
+        if (format_problem)
+            fprintf(stderr, "%s: invalid format, %s\n", in_fname,
+                    format_problem);
+        return 1;
+    }
+    out = fopen(out_fname, "wb");
+    if (!out) {
+        fprintf(stderr, "Failed to open %s for writing: %s\n",
+                out_fname, strerror(errno));
+        close_flat_rows(stream);
+        return 1;
+    }
+    fprintf(out, "P6\n%ld %ld\n255\n", stream->width, stream->height);
+    for (y = 0; y < stream->height && is_ok; y++) {
+        is_ok = read_flat_stream_row(stream);
+        if (!is_ok) {
+            fprintf(stderr, "%s: invalid format, %s\n", in_fname,
+                    format_problem);
+        } else if (fwrite(stream->row, 3, stream->width, out)
+                   != stream->width) {
+            fprintf(stderr, "Unable to write complete image\n");
+            is_ok = 0;
+        }
+    }
+    if (fclose(out) != 0) {
+        fprintf(stderr, "Failure on closing output: %s\n", strerror(errno));
+        is_ok = 0;
+    }
+    if (!is_ok)
+        remove(out_fname);
+    else
+        printf("Streamed %ld rows of %s into %s\n", stream->height,
+               in_fname, out_fname);
+    close_flat_rows(stream);
+    return !is_ok;
+}
+
+/* Thumbnail mode: write the thumbnail stored in an image to a PPM
+   file, without reading the rest of the image. Returns the exit
+   status for the program. */
+int thumbnail_convert(const char *in_fname, const char *out_fname) {
+    struct image_info *info = parse_thumbnail(in_fname);
+    if (!info)
+        return 1;
+    write_ppm(info, out_fname);
+    printf("Thumbnail of %s, %ldx%ld, in %s\n", in_fname, info->width,
+           info->height, out_fname);
+    free_image_info(info);
+    return 0;
+}
+
+/* Range of rows to convert in batch mode, if batch_num_rows is
+   nonzero; otherwise the whole image is converted. */
+long batch_first_row = 0, batch_num_rows = 0;
+
+/* Read a BCFLAT image from standard input, which may be a pipe,
+   decoding it as the data arrives (see parse_bcflat_push), and
+   reporting problems like parse_image. Returns a pointer to the
+   image, or a null pointer on failure. */
+struct image_info *read_stdin_image(void) {
+    unsigned char magic[8];
+    struct image_info *info;
+    long rows;
+
+    /* Nothing past the tags may be left in stdio's buffer */
+    setvbuf(stdin, 0, _IONBF, 0);
+    if (fread(magic, 8, 1, stdin) != 1) {
+        fprintf(stderr, "Failed to read magic number from standard input\n");
+        return 0;
+    }
+    if (memcmp(magic, bcflat_magic, 8) != 0) {
+        fprintf(stderr, "Standard input must be a BCFLAT image\n");
+        return 0;
+    }
+    format_problem = 0;
+    info = parse_bcflat_push(stdin, &rows);
+    free(flat_row_index);
+    flat_row_index = 0;
+    if (!info) {
+        if (format_problem && rows)
+            fprintf(stderr, "standard input: invalid format, %s, after %ld"
+                    " complete rows\n", format_problem, rows);
+        else if (format_problem)
+            fprintf(stderr, "standard input: invalid format, %s\n",
+                    format_problem);
+        else
+            fprintf(stderr, "standard input: invalid format\n");
+    }
+    return info;
+}
+
+/* Batch conversion mode: convert one image into a PPM file next to
+   it. An image name of "-" reads a BCFLAT image from standard input
+   into stdin.ppm. Returns the exit status for the program. */
+int batch_convert(const char *fname) {
+    struct image_info *info;
+    char *out_fname;
+    if (!strcmp(fname, "-")) {
+        if (batch_num_rows) {
+            fprintf(stderr, "Can't convert only some rows of standard"
+                    " input\n");
+            return 1;
+        }
+        info = read_stdin_image();
+        fname = "stdin";
+    } else if (batch_num_rows) {
+        info = parse_image_rows(fname, batch_first_row, batch_num_rows);
+    } else {
+        info = parse_image(fname);
+    }
+    out_fname = xmalloc(strlen(fname) + 5);
+    if (!info)
+        return 1;
+    strcpy(out_fname, fname);
+    strcat(out_fname, ".ppm");
+    printf("Batch conversion output in %s\n", out_fname);
+    write_ppm(info, out_fname);
+    free(out_fname);
+    print_log_msg(info);
+    free_image_info(info);
+    (*per_image_callback)();
+    return 0;
+}
+
+/* Name of the image format with magic number "magic", or a null
+   pointer if it isn't one we can read. */
+const char *format_name(const unsigned char *magic) {
+    if (!memcmp(magic, bcraw_magic, 8))
+        return "BCRAW";
+    if (!memcmp(magic, bcprog_magic, 8))
+        return "BCPROG";
+    if (!memcmp(magic, bcflat_magic, 8))
+        return "BCFLAT";
+    if (!memcmp(magic, bcflat2_magic, 8))
+        return "BCFLAT2";
+    if (!memcmp(magic, bcseq_magic, 8))
+        return "BCSEQ";
+    return 0;
+}
+
+/* An image to be added to a pack by write_pack. */
+struct pack_member {
+    const char *name;
+    unsigned char header[32];   /* magic, flags, width and height */
+    long size;
+};
+
+/* qsort comparison function for pack members, by name. strcmp
+   compares as unsigned chars, which is the order of memcmp. */
+static int compare_pack_members(const void *a, const void *b) {
+    return strcmp(((const struct pack_member *)a)->name,
+                  ((const struct pack_member *)b)->name);
+}
+
+/* Pack building mode: write the images "fnames" into a new pack
+   "out_fname", each under the name it was given by. The images are
+   checked only as far as their headers. Returns the exit status for
+   the program. */
+int write_pack(const char *out_fname, int num_files, char **fnames) {
+    struct pack_member *members = xmalloc(num_files * sizeof(*members));
+    unsigned char *buf = xmalloc(FLAT_INPUT_SIZE);
+    long i, names_size = 0, offset;
+    char *tmp_fname;
+    FILE *in, *out;
+    int is_ok = 1;
+
+    for (i = 0; i < num_files && is_ok; i++) {
+        struct stat st;
+        members[i].name = fnames[i];
+        in = fopen(fnames[i], "rb");
+        if (!in || fstat(fileno(in), &st) != 0) {
+            fprintf(stderr, "Failed to open %s: %s\n", fnames[i],
+                    strerror(errno));
+            if (in)
+                fclose(in);
+            is_ok = 0;
+            break;
+        }
+        members[i].size = st.st_size;
+        if (fread(members[i].header, 32, 1, in) != 1
+            || !format_name(members[i].header)) {
+            fprintf(stderr, "%s: unrecognized format\n", fnames[i]);
+            is_ok = 0;
+        }
+        fclose(in);
+        names_size += strlen(fnames[i]);
+    }
+    if (is_ok)
+        qsort(members, num_files, sizeof(*members), compare_pack_members);
+    for (i = 1; i < num_files && is_ok; i++) {
+        if (!strcmp(members[i - 1].name, members[i].name)) {
+            fprintf(stderr, "%s is in the pack twice\n", members[i].name);
+            is_ok = 0;
+        }
+    }
+    out = is_ok ? open_output(out_fname, &tmp_fname) : 0;
+    if (!out) {
+        free(members);
+        free(buf);
+        return 1;
+    }
+
+    fwrite(bcpack_magic, 8, 1, out);
+    write_u64_bigendian(out, num_files);
+    write_u64_bigendian(out, names_size);
+    /* The images go after the name table, in the same order */
+    offset = PACK_HEADER_SIZE + num_files * PACK_ENTRY_SIZE + names_size;
+    names_size = 0;
+    for (i = 0; i < num_files; i++) {
+        long name_len = strlen(members[i].name);
+        write_u64_bigendian(out, names_size);
+        write_u64_bigendian(out, name_len);
+        write_u64_bigendian(out, offset);
+        write_u64_bigendian(out, members[i].size);
+        fwrite(members[i].header, 8, 1, out);
+        write_u64_bigendian(out, load_u64_bigendian(members[i].header + 16));
+        write_u64_bigendian(out, load_u64_bigendian(members[i].header + 24));
+        names_size += name_len;
+        offset += members[i].size;
+    }
+    for (i = 0; i < num_files; i++)
+        fwrite(members[i].name, strlen(members[i].name), 1, out);
+    for (i = 0; i < num_files && is_ok; i++) {
+        long left = members[i].size;
+        in = fopen(members[i].name, "rb");
+        if (!in) {
+            fprintf(stderr, "Failed to open %s: %s\n", members[i].name,
+                    strerror(errno));
+            is_ok = 0;
+            break;
+        }
+        while (left > 0) {
+            size_t num = fread(buf, 1, MIN(left, FLAT_INPUT_SIZE), in);
+            if (num == 0)
+                break;
+            fwrite(buf, num, 1, out);
+            left -= num;
+        }
+        if (left != 0 || fgetc(in) != EOF) {
+            fprintf(stderr, "%s changed while being packed\n",
+                    members[i].name);
+            is_ok = 0;
+        }
+        fclose(in);
+    }
+    free(buf);
+    if (!is_ok) {
+        fclose(out);
+        remove(tmp_fname);
+        free(tmp_fname);
+        free(members);
+        return 1;
+    }
+    is_ok = close_output(out, tmp_fname, out_fname);
+    if (is_ok)
+        printf("Packed %d images into %s\n", num_files, out_fname);
+    free(members);
+    return !is_ok;
+}
+
+/* Pack listing mode: print the name, format, size and length of every
+   image in a pack, in directory order. Returns the exit status for
+   the program. */
+int list_pack(const char *fname) {
+    struct image_pack *pack = open_pack(fname);
+    long i;
+    if (!pack)
+        return 1;
+    for (i = 0; i < pack->num_members; i++) {
+        const char *format = format_name(pack->dir + i * PACK_ENTRY_SIZE
+                                         + PACK_FORMAT);
+        printf("%-8s %6ldx%-6ld %10ld  %.*s\n", format ? format : "?",
+               pack_field(pack, i, PACK_WIDTH),
+               pack_field(pack, i, PACK_HEIGHT),
+               pack_field(pack, i, PACK_LENGTH),
+               (int)pack_field(pack, i, PACK_NAME_LEN),
+               pack->names + pack_field(pack, i, PACK_NAME));
+    }
+    close_pack(pack);
+    return 0;
+}
+
+/* Pack extraction mode: convert the members "names" of a pack into
+   PPM files, as batch_convert would convert the original images.
+   Returns the exit status for the program. */
+int extract_pack(const char *fname, int num_names, char **names) {
+    struct image_pack *pack = open_pack(fname);
+    int i, status = 0;
+    if (!pack)
+        return 1;
+    for (i = 0; i < num_names; i++) {
+        struct image_info *info = parse_pack_image(pack, names[i]);
+        char *out_fname;
+        if (!info) {
+            status = 1;
+            continue;
+        }
+        out_fname = xmalloc(strlen(names[i]) + 5);
+        strcpy(out_fname, names[i]);
+        strcat(out_fname, ".ppm");
+        printf("Extracted %s from %s into %s\n", names[i], fname, out_fname);
+        write_ppm(info, out_fname);
+        free(out_fname);
+        print_log_msg(info);
+        free_image_info(info);
+        (*per_image_callback)();
+    }
+    close_pack(pack);
+    return status;
+}
+
 int main(int argc, char *argv[]) {
-    int res;
+    int res, opt, batch = 0, index = 0, validate = 0, stream = 0, encode = 0;
+    int dither = 0, compare = 0, thumbnail = 0, pack = 0, list = 0;
+    int extract = 0;
+    char *end;
     struct rlimit rlim;
 
     per_image_callback = &benign_target;
@@ -213,46 +1616,219 @@ int main(int argc, char *argv[]) {
         size_limit = (long)sqrt(rlim.rlim_cur * 1024 / 3);
     }
 
-    if (argc == 3 && argv[1][0] == '-' && argv[1][1] == 'c' && !argv[1][2]) {
-        /* Batch conversion mode; don't start the GUI. */
-        struct image_info *info = parse_image(argv[2]);
-        char *out_fname = xmalloc(strlen(argv[2]) + 5);
-        if (!info)
+    while ((opt = getopt(argc, argv, "CPT:cdef:ij:klm:pr:stvx")) != -1) {
+        switch (opt) {
+        case 'C':
+            /* Compare the sizes and decoding speeds of the BCFLAT
+               codec variants */
+            compare = 1;
+            break;
+        case 'P':
+            /* Build a pack of images */
+            pack = 1;
+            break;
+        case 'T':
+            /* Add a thumbnail to images encoded with -e */
+            if (!parse_thumbnail_option(optarg))
+                return 1;
+            break;
+        case 'c':
+            /* Batch conversion mode; don't start the GUI. */
+            batch = 1;
+            break;
+        case 'd':
+            /* Dither images encoded as BCPROG */
+            dither = 1;
+            break;
+        case 'e':
+            /* Encode an image as BCFLAT */
+            encode = 1;
+            break;
+        case 'f':
+            /* Frame rate of sequences encoded with -e, or played in
+               the GUI */
+            frame_rate = strtod(optarg, &end);
+            if (end == optarg || *end || !(frame_rate > 0)) {
+                fprintf(stderr, "Frame rate must be positive\n");
+                return 1;
+            }
+            break;
+        case 'i':
+            /* Add a row index to a BCFLAT image, or with -e, include
+               one when encoding */
+            index = 1;
+            break;
+        case 'j':
+            /* Number of threads for decoding BCFLAT images, and for
+               encoding */
+            flat_threads = atoi(optarg);
+            if (flat_threads < 1) {
+                fprintf(stderr, "Number of threads must be positive\n");
+                return 1;
+            }
+            break;
+        case 'k':
+            /* Add a checksum to images encoded with -e */
+            write_data_crc = 1;
+            break;
+        case 'l':
+            /* List the images in a pack */
+            list = 1;
+            break;
+        case 'm':
+            /* Codec variant for BCFLAT images encoded with -e */
+            if (!parse_flat_codec(optarg, &encode_predictor,
+                                  &encode_long_runs))
+                return 1;
+            break;
+        case 'p':
+            /* Decode the color planes of BCFLAT images in parallel */
+            flat_planar = 1;
+            break;
+        case 'r':
+            /* Convert only some rows of the image */
+            if (sscanf(optarg, "%ld,%ld", &batch_first_row,
+                       &batch_num_rows) != 2
+                || batch_first_row < 0 || batch_num_rows < 1) {
+                fprintf(stderr, "Row range should be <first row>,<rows>\n");
+                return 1;
+            }
+            break;
+        case 's':
+            /* Convert a BCFLAT image to PPM without reading it all
+               into memory */
+            stream = 1;
+            break;
+        case 't':
+            /* Extract the thumbnail of an image */
+            thumbnail = 1;
+            break;
+        case 'v':
+            /* Check images without converting or displaying them */
+            validate = 1;
+            break;
+        case 'x':
+            /* Convert images in a pack to PPM */
+            extract = 1;
+            break;
+        default:
+            usage();
             return 1;
-        strcpy(out_fname, argv[2]);
+        }
+    }
+
+    if (pack + list + extract > 1 || (batch_num_rows && !batch)) {
+        /* -r only goes with -c */
+        usage();
+        return 1;
+    } else if (pack && !compare && !encode && !thumbnail && !batch
+               && !stream && !validate && !index && optind <= argc - 2) {
+        return write_pack(argv[optind], argc - optind - 1, argv + optind + 1);
+    } else if (list && !compare && !encode && !thumbnail && !batch
+               && !stream && !validate && !index && optind == argc - 1) {
+        return list_pack(argv[optind]);
+    } else if (extract && !compare && !encode && !thumbnail && !batch
+               && !stream && !validate && !index && optind <= argc - 2) {
+        return extract_pack(argv[optind], argc - optind - 1,
+                            argv + optind + 1);
+    } else if (pack || list || extract) {
+        usage();
+        return 1;
+    } else if (thumbnail && !compare && !encode && !batch && !stream
+               && !validate && !index
+               && (optind == argc - 1 || optind == argc - 2)) {
+        /* By default, the output goes next to the input */
+        char *out_fname;
+        if (optind == argc - 2)
+            return thumbnail_convert(argv[optind], argv[optind + 1]);
+        out_fname = xmalloc(strlen(argv[optind]) + 11);
+        strcpy(out_fname, argv[optind]);
+        strcat(out_fname, ".thumb.ppm");
+        res = thumbnail_convert(argv[optind], out_fname);
+        free(out_fname);
+        return res;
+    } else if (thumbnail) {
+        usage();
+        return 1;
+    } else if (compare && !encode && !batch && !stream && !validate && !index
+        && optind < argc) {
+        return compare_codecs(argc - optind, argv + optind);
+    } else if (compare) {
+        usage();
+        return 1;
+    } else if (encode && !batch && !stream && !validate
+        && optind <= argc - 2 && has_suffix(argv[argc - 1], ".bcseq")) {
+        /* Every other argument is a frame */
+        return encode_sequence(argc - optind - 1, argv + optind,
+                               argv[argc - 1]);
+    } else if (encode && !batch && !stream && !validate
+        && (optind == argc - 1 || optind == argc - 2)) {
+        /* By default, the output is BCFLAT next to the input */
+        char *out_fname;
+        if (optind == argc - 2)
+            return encode_image(argv[optind], argv[optind + 1], index,
+                                dither);
+        out_fname = xmalloc(strlen(argv[optind]) + 8);
+        strcpy(out_fname, argv[optind]);
+        strcat(out_fname, ".bcflat");
+        res = encode_image(argv[optind], out_fname, index, dither);
+        free(out_fname);
+        return res;
+    } else if (encode || dither || encode_predictor || encode_long_runs
+               || thumbnail_size || write_data_crc) {
+        usage();
+        return 1;
+    } else if (stream && !batch && !index && !validate
+        && (optind == argc - 1 || optind == argc - 2)) {
+        /* By default, the output goes next to the input */
+        char *out_fname;
+        if (optind == argc - 2)
+            return stream_convert(argv[optind], argv[optind + 1]);
+        out_fname = xmalloc(strlen(argv[optind]) + 5);
+        strcpy(out_fname, argv[optind]);
         strcat(out_fname, ".ppm");
-        printf("Batch conversion output in %s\n", out_fname);
-        write_ppm(info, out_fname);
+        res = stream_convert(argv[optind], out_fname);
         free(out_fname);
-        print_log_msg(info);
-        free_image_info(info);
-        (*per_image_callback)();
-        return 0;
+        return res;
+    } else if (stream) {
+        usage();
+        return 1;
+    } else if (validate && !batch && !index && optind < argc) {
+        return validate_images(argc - optind, argv + optind);
+    } else if (validate) {
+        usage();
+        return 1;
+    } else if (index && !batch && (optind == argc - 1 || optind == argc - 2)) {
+        /* Without a separate output file, index in place */
+        return index_bcflat(argv[optind], argv[argc - 1]);
+    } else if (index) {
+        usage();
+        return 1;
+    } else if (batch && optind == argc - 1) {
+        return batch_convert(argv[optind]);
 #ifdef DISABLE_GUI
     } else {
-        fprintf(stderr, "Usage: bcimgview-nogui -c <image>\n");
+        usage();
         return 1;
     }
 #else
-    } else if (argc == 1 || argc == 2) {
+    } else if (!batch && optind >= argc - 1) {
         /* GUI mode */
         GtkWidget *window;
+        const char *fname = optind < argc ? argv[optind] : 0;
         gtk_init(&argc, &argv);
 
         window = create_window();
         gtk_widget_show_all(window);
 
-        if (argc == 2) {
-            struct image_info *info = parse_image(argv[1]);
-            if (info)
-                display_image(info, global_image);
-        }
+        if (fname)
+            open_image(fname, global_image);
 
         gtk_main();
     } else {
-        fprintf(stderr, "Usage: bcimgview [-c] [<image>]\n");
+        usage();
         return 1;
     }
 #endif
     return 0;
-}
\ No newline at end of file
+}